@@ -22,6 +22,14 @@ ifneq ($(debug),y)
 FLAGS += -DNDEBUG
 endif
 
+ifeq ($(bench),y)
+FLAGS += -DBENCH
+endif
+
+ifeq ($(tlog),y)
+FLAGS += -DTLOG
+endif
+
 FLAGS += -MMD -MF .$(@F).d
 DEPS = .*.d
 
@@ -77,6 +85,11 @@ build.o: $(OBJS)
 %.dfu: %.hex
 	$(PYTHON) $(ROOT)/scripts/dfu-convert.py -i $< -D $(DFU_DEV) $@
 
+%.logfmt: %.elf
+	@echo OBJCOPY $@
+	$(OBJCOPY) --dump-section .logfmt=$@ $<
+	chmod a-x $@
+
 %.bin: %.elf
 	@echo OBJCOPY $@
 	$(OBJCOPY) -O binary $< $@
@@ -91,7 +104,7 @@ build.o: $(OBJS)
 	$(CC) $(AFLAGS) -c $< -o $@
 
 clean:: $(addprefix _clean_,$(SUBDIRS) $(SUBDIRS-n) $(SUBDIRS-))
-	rm -f *.orig *.rej *~ *.o *.elf *.hex *.dfu *.bin *.ld $(DEPS)
+	rm -f *.orig *.rej *~ *.o *.elf *.hex *.dfu *.bin *.ld *.logfmt $(DEPS)
 _clean_%: FORCE
 	$(MAKE) -f $(ROOT)/Rules.mk -C $* clean
 
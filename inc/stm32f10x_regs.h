@@ -102,6 +102,34 @@ struct nvic {
 
 #define NVIC_BASE 0xe000e100
 
+/* Core debug */
+struct dbg {
+    uint32_t dhcsr;    /* 00: Debug halting control and status */
+    uint32_t dcrsr;    /* 04: Debug core register selector */
+    uint32_t dcrdr;    /* 08: Debug core register data */
+    uint32_t demcr;    /* 0C: Debug exception and monitor control */
+};
+
+#define DBG_DEMCR_TRCENA       (1u<<24)
+
+#define DBG_BASE 0xe000edf0
+
+/* Data watchpoint and trace */
+struct dwt {
+    uint32_t ctrl;     /* 00: Control */
+    uint32_t cyccnt;   /* 04: Cycle count */
+    uint32_t cpicnt;   /* 08: CPI count */
+    uint32_t exccnt;   /* 0C: Exception overhead count */
+    uint32_t sleepcnt; /* 10: Sleep count */
+    uint32_t lsucnt;   /* 14: LSU count */
+    uint32_t foldcnt;  /* 18: Folded-instruction count */
+    uint32_t pcsr;     /* 1C: Program counter sample */
+};
+
+#define DWT_CTRL_CYCCNTENA     (1u<< 0)
+
+#define DWT_BASE 0xe0001000
+
 /* Flash memory interface */
 struct flash {
     uint32_t acr;      /* 00: Flash access control */
@@ -422,8 +450,30 @@ struct tim {
 #define TIM_CR1_CEN          (1u<<0)
 
 #define TIM_CR2_TI1S         (1u<<7)
+#define TIM_CR2_MMS(x)       ((x)<<4)
 #define TIM_CR2_CCDS         (1u<<3)
 
+#define TIM_MMS_RESET        0
+#define TIM_MMS_ENABLE       1
+#define TIM_MMS_UPDATE       2
+
+#define TIM_SMCR_ETP         (1u<<15)
+#define TIM_SMCR_ECE         (1u<<14)
+#define TIM_SMCR_MSM         (1u<< 7)
+#define TIM_SMCR_TS(x)       ((x)<< 4)
+#define TIM_SMCR_SMS(x)      ((x)<< 0)
+
+#define TIM_TS_ITR0          0
+#define TIM_TS_ITR1          1
+#define TIM_TS_ITR2          2
+#define TIM_TS_ITR3          3
+
+#define TIM_SMS_DISABLED     0
+#define TIM_SMS_RESET        4
+#define TIM_SMS_GATED        5
+#define TIM_SMS_TRIGGER      6
+#define TIM_SMS_EXT_CLK1     7
+
 #define TIM_DIER_TDE         (1u<<14)
 #define TIM_DIER_CC4DE       (1u<<12)
 #define TIM_DIER_CC3DE       (1u<<11)
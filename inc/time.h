@@ -1,7 +1,7 @@
 /*
  * time.h
  * 
- * System-time abstraction over STM32 STK timer.
+ * System-time abstraction over chained STM32 TIM2/TIM3 timers.
  * 
  * Written & released by Keir Fraser <keir.xen@gmail.com>
  * 
@@ -19,6 +19,7 @@ typedef uint32_t time_t;
 
 void delay_from(time_t t, unsigned int ticks);
 time_t time_now(void);
+uint64_t time64_now(void); /* never wraps */
 
 #define time_diff(x,y) ((int32_t)((y)-(x))) /* d = y - x */
 #define time_add(x,d)  ((time_t)((x)+(d)))  /* y = x + d */
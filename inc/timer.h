@@ -13,7 +13,11 @@ struct timer {
     time_t deadline;
     void (*cb_fn)(void *);
     void *cb_dat;
-    struct timer *next;
+    struct timer *next, **pprev;
+    uint16_t slot;
+    /* Callback lateness versus deadline, in ticks. */
+    uint16_t lat_nr;
+    int32_t lat_min, lat_max, lat_sum;
 };
 
 /* Safe to call from any priority level same or lower than TIMER_IRQ_PRI. */
@@ -22,6 +26,14 @@ void timer_set(struct timer *timer, time_t deadline);
 void timer_cancel(struct timer *timer);
 
 void timers_init(void);
+void timers_calibrate(void);
+
+/* Report callback lateness of each timer that has fired. */
+void timer_stats_dump(void);
+
+#if defined(BENCH)
+void timer_bench(void);
+#endif
 
 /*
  * Local variables:
@@ -59,24 +59,85 @@ int snprintf(char *str, size_t size, const char *format, ...)
 /* Log output, to serial console or logfile. */
 int vprintk(const char *format, va_list ap)
     __attribute__ ((format (printf, 1, 0)));
+#if defined(TLOG)
+/* Tokenized logging: format strings are collected in the unloaded .logfmt
+ * section and only a string ID (the string's offset in that section) and
+ * the raw arguments are logged. Arguments must be at most 32 bits wide.
+ * String arguments are copied inline. Decode with scripts/tlog.py. */
+void tlog(const char *fmt, uint32_t strmask, unsigned int nr, ...);
+#define __tlog_str(x) _Generic((x)+0, char *: 1u, const char *: 1u, \
+                               default: 0u)
+#define __tlog_nr(...) __tlog_nr_(0, ##__VA_ARGS__, 8,7,6,5,4,3,2,1,0)
+#define __tlog_nr_(_0,_1,_2,_3,_4,_5,_6,_7,_8,n,...) n
+#define __tlog_mask(...) __tlog_mask_(__tlog_nr(__VA_ARGS__), ##__VA_ARGS__)
+#define __tlog_mask_(n, ...) __tlog_mask__(n, ##__VA_ARGS__)
+#define __tlog_mask__(n, ...) __tlog_mask##n(__VA_ARGS__)
+#define __tlog_mask0() 0u
+#define __tlog_mask1(a) __tlog_str(a)
+#define __tlog_mask2(a, ...) (__tlog_str(a) | __tlog_mask1(__VA_ARGS__)<<1)
+#define __tlog_mask3(a, ...) (__tlog_str(a) | __tlog_mask2(__VA_ARGS__)<<1)
+#define __tlog_mask4(a, ...) (__tlog_str(a) | __tlog_mask3(__VA_ARGS__)<<1)
+#define __tlog_mask5(a, ...) (__tlog_str(a) | __tlog_mask4(__VA_ARGS__)<<1)
+#define __tlog_mask6(a, ...) (__tlog_str(a) | __tlog_mask5(__VA_ARGS__)<<1)
+#define __tlog_mask7(a, ...) (__tlog_str(a) | __tlog_mask6(__VA_ARGS__)<<1)
+#define __tlog_mask8(a, ...) (__tlog_str(a) | __tlog_mask7(__VA_ARGS__)<<1)
+#define printk(fmt, ...) ({                                             \
+    static const char __fmt[] __attribute__((section(".logfmt"))) = fmt; \
+    tlog(__fmt, __tlog_mask(__VA_ARGS__), __tlog_nr(__VA_ARGS__),       \
+         ##__VA_ARGS__);                                                \
+    0; })
+#else
 int printk(const char *format, ...)
     __attribute__ ((format (printf, 1, 2)));
+#endif
 #else /* NDEBUG && !LOGFILE */
 static inline int vprintk(const char *format, va_list ap) { return 0; }
 static inline int printk(const char *format, ...) { return 0; }
 #endif
 
-#if !defined(NDEBUG)
-/* Serial console control */
+/* Serial console. Always present, for the command shell: console_printf()
+ * output is not affected by NDEBUG. Ctrl-\ on input forces a crash dump. */
 void console_init(void);
+int console_printf(const char *format, ...)
+    __attribute__ ((format (printf, 1, 2)));
+bool_t console_getline(char *buf, size_t len);
+/* Raw binary output, such as the USB trace dump. */
+void console_write(const void *buf, size_t len);
+#if !defined(NDEBUG)
 void console_sync(void);
-void console_crash_on_input(void);
 #else /* NDEBUG */
-#define console_init() ((void)0)
 #define console_sync() IRQ_global_disable()
-#define console_crash_on_input() ((void)0)
 #endif
 
+/* ADC: continuous, oversampled conversion of the analogue inputs. */
+enum { ADC_CC1 = 0, ADC_CC2, ADC_VREFINT, ADC_NR };
+void adc_init(void);
+/* Filtered value as a 12-bit fraction of VDDA. */
+unsigned int adc_read(unsigned int ch);
+/* Filtered value in mV, referenced to Vrefint. */
+unsigned int adc_read_mv(unsigned int ch);
+/* Analogue supply rail in mV, referenced to Vrefint. */
+unsigned int adc_vdda_mv(void);
+/* Fill p[ADC_NR] with each channel's profile in mV since the last call.
+ * The ADC_VREFINT entry profiles VDDA. */
+struct adc_profile {
+    uint16_t min, max;
+    uint32_t sum, nr;
+};
+void adc_profile_take(struct adc_profile *p);
+
+/* Record store in the flash reserved above the firmware image. Record
+ * types are 0x00-0xfe, with up to 255 bytes of payload. */
+struct store_iter {
+    unsigned int page, off;
+};
+void store_init(void);
+void store_erase(void);
+bool_t store_append(uint8_t type, const void *p, unsigned int len);
+const void *store_next(struct store_iter *it, uint8_t *type,
+                       unsigned int *len);
+uint32_t store_seq(void);
+
 /* CRC-CCITT */
 uint16_t crc16_ccitt(const void *buf, size_t len, uint16_t crc);
 
@@ -93,6 +154,29 @@ void usbh_cdc_init(void);
 void usbh_cdc_buffer_set(uint8_t *buf);
 void usbh_cdc_process(void);
 bool_t usbh_cdc_connected(void);
+bool_t usbh_cdc_set_baud(uint32_t baud);
+void usbh_cdc_abort(void);
+bool_t usbh_hub_attached(void);
+void usb_trace_dump(void);
+
+/* DUT identity, from its USB descriptors. Cleared on disconnect. */
+struct usb_dut_desc {
+    uint16_t vid, pid;
+    char serial[32];
+};
+void usbh_dut_desc(struct usb_dut_desc *desc);
+
+/* USB link quality counters, per host channel. */
+struct usb_link_stats {
+    uint32_t nak, nyet, xacterr, bblerr, datatglerr, stall;
+    uint32_t retries; /* URBs resubmitted after NAK or error */
+    uint32_t bytes;
+};
+void usbh_cdc_link_stats(struct usb_link_stats *out,
+                         struct usb_link_stats *in);
+#if defined(BENCH)
+void usb_fifo_bench(void);
+#endif
 
 /* Build info. */
 extern const char fw_ver[];
@@ -104,6 +188,7 @@ extern char _stext[], _etext[];
 extern char _smaintext[], _emaintext[];
 extern char _sdat[], _edat[], _ldat[];
 extern char _sbss[], _ebss[];
+extern char _sstore[], _estore[];
 
 /* Stacks. */
 extern uint32_t _thread_stacktop[], _thread_stackbottom[];
@@ -116,6 +201,7 @@ void EXC_unused(void);
 #define RESET_IRQ_PRI         0
 #define TIMER_IRQ_PRI         4
 #define USB_IRQ_PRI          14
+#define USB_SOFTIRQ_PRI      15
 #define CONSOLE_IRQ_PRI      15
 
 /*
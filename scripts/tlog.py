@@ -0,0 +1,86 @@
+# tlog.py
+#
+# Decode tokenized console output from a tlog=y build.
+#
+# Usage: tlog.py <GW_TestBoard.logfmt> <console_capture>
+#
+# The .logfmt dictionary is generated alongside the firmware image.
+#
+# Written & released by Keir Fraser <keir.xen@gmail.com>
+#
+# This is free and unencumbered software released into the public domain.
+# See the file COPYING for more details, or visit <http://unlicense.org>.
+
+import re, struct, sys
+
+# Must match src/console.c
+TLOG_SYNC = 0x1e
+
+SPEC = re.compile(r'%([-+ #0]*)(\d*|\*)(?:\.(\d+))?(hh|h|ll|l|z)?([diuxXopcs%])')
+
+def fmt_lookup(dic, off):
+    end = dic.find(b'\0', off)
+    return dic[off:end].decode('ascii', 'replace')
+
+def render(fmt, args):
+    out, pos, argi = [], 0, 0
+    for m in SPEC.finditer(fmt):
+        out.append(fmt[pos:m.start()])
+        pos = m.end()
+        flags, width, prec, _, conv = m.groups()
+        if conv == '%':
+            out.append('%')
+            continue
+        if width == '*':
+            width = str(args[argi])
+            argi += 1
+        a = args[argi] if argi < len(args) else 0
+        argi += 1
+        spec = '%' + flags + width + ('.' + prec if prec else '')
+        if conv == 's':
+            out.append((spec + 's') % a)
+        elif conv == 'p':
+            out.append('0x%08x' % a)
+        elif conv in 'di':
+            out.append((spec + 'd') % (a - (1 << 32) if a & (1 << 31) else a))
+        elif conv == 'u':
+            out.append((spec + 'd') % a)
+        elif conv == 'c':
+            out.append(chr(a & 0xff))
+        else:
+            out.append((spec + conv) % a)
+    out.append(fmt[pos:])
+    return ''.join(out)
+
+def decode(dic, data):
+    out, off = [], 0
+    while off < len(data):
+        if data[off] != TLOG_SYNC or off + 5 > len(data):
+            # Raw output (eg. console_write): pass through.
+            out.append(chr(data[off]))
+            off += 1
+            continue
+        fid, nr, mask = struct.unpack_from('<HBB', data, off+1)
+        p, args = off + 5, []
+        try:
+            for i in range(nr):
+                if mask & (1 << i):
+                    l = data[p]
+                    args.append(data[p+1:p+1+l].decode('ascii', 'replace'))
+                    p += 1 + l
+                else:
+                    args.append(struct.unpack_from('<I', data, p)[0])
+                    p += 4
+        except (IndexError, struct.error):
+            break # truncated capture
+        out.append(render(fmt_lookup(dic, fid), args))
+        off = p
+    return ''.join(out)
+
+def main(argv):
+    dic = open(argv[1], 'rb').read()
+    data = open(argv[2], 'rb').read()
+    sys.stdout.write(decode(dic, data))
+
+if __name__ == "__main__":
+    main(sys.argv)
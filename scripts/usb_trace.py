@@ -0,0 +1,62 @@
+# usb_trace.py
+#
+# Decode USB host channel trace dumps from a captured console log.
+#
+# Usage: usb_trace.py <console_capture>
+#
+# Written & released by Keir Fraser <keir.xen@gmail.com>
+#
+# This is free and unencumbered software released into the public domain.
+# See the file COPYING for more details, or visit <http://unlicense.org>.
+
+import sys, struct
+
+# Must match enum in src/usb/stm32_usbh/inc/usb_trace.h
+EVENTS = [ 'START', 'ACK', 'NAK', 'NYET', 'STALL', 'XACTERR',
+           'DATATGLERR', 'FRMOVRUN', 'XFRC', 'HALT', 'URB', 'BBLERR' ]
+URB_STATES = [ 'IDLE', 'DONE', 'NOTREADY', 'ERROR', 'STALL' ]
+
+HDR = struct.Struct('<4sBBHI')
+
+def decode(data, off):
+    magic, ver, ent_size, nr, mhz = HDR.unpack_from(data, off)
+    if ver != 1:
+        print('Unsupported trace version %d' % ver)
+        return off + HDR.size
+    off += HDR.size
+    t0 = None
+    for i in range(nr):
+        t, count, ch, ev = struct.unpack_from('<IHBB', data, off)
+        off += ent_size
+        if t0 is None:
+            t0 = t
+        us = ((t - t0) & 0xffffffff) / mhz
+        name = EVENTS[ev] if ev < len(EVENTS) else '?%d' % ev
+        dirn = 'IN ' if ch & 0x80 else 'OUT'
+        if ev == EVENTS.index('URB'):
+            arg = URB_STATES[count] if count < len(URB_STATES) else count
+        elif ev == EVENTS.index('NAK'):
+            arg = 'x%d' % count
+        elif ev in (EVENTS.index('START'), EVENTS.index('HALT')):
+            arg = '%d bytes' % count
+        else:
+            arg = ''
+        print('%12.1fus  ch%d %s  %-10s %s' % (us, ch & 0x7f, dirn,
+                                               name, arg))
+    return off
+
+def main(argv):
+    data = open(argv[1], 'rb').read()
+    off, found = 0, 0
+    while True:
+        off = data.find(b'UTRC', off)
+        if off < 0 or off + HDR.size > len(data):
+            break
+        found += 1
+        print('** Trace %d' % found)
+        off = decode(data, off)
+    if not found:
+        print('No trace found')
+
+if __name__ == "__main__":
+    main(sys.argv)
@@ -0,0 +1,181 @@
+/*
+ * adc.c
+ *
+ * Continuous scan-mode conversion of the analogue inputs into a circular
+ * DMA buffer. Readers take the sum over the whole buffer: an oversampled,
+ * decimated value which is available immediately without waiting on the
+ * ADC.
+ *
+ * A timer also profiles every channel in mV, for the DUT power signature.
+ *
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#define dma_adc (dma1->ch1) /* ADC1 */
+#define DMA_ADC_CH 1
+
+/* Internal reference voltage, typical (datasheet: 1.16-1.24V). Absolute mV
+ * readings are therefore good to only about +/-3%. Values relative to VDDA
+ * (adc_read()), and differences between mV readings taken against the same
+ * reference, are scaled by the same error and so are good to 3% of
+ * themselves. */
+#define VREFINT_MV 1200
+
+/* Scan sequence, indexed by enum ADC_*. */
+static const uint8_t adc_channels[ADC_NR] = {
+    [ADC_CC1] = 0,      /* PA0 */
+    [ADC_CC2] = 1,      /* PA1 */
+    [ADC_VREFINT] = 17
+};
+
+/* Scans held in the DMA ring. At 9MHz ADCCLK and maximal sample time each
+ * conversion takes 28us, so the ring spans ~1.3ms of samples. */
+#define ADC_SCANS 16
+static uint16_t adc_buf[ADC_SCANS * ADC_NR];
+
+static uint32_t adc_sum(unsigned int ch)
+{
+    uint32_t sum = 0;
+    unsigned int i;
+    for (i = ch; i < ARRAY_SIZE(adc_buf); i += ADC_NR)
+        sum += adc_buf[i];
+    return sum;
+}
+
+unsigned int adc_read(unsigned int ch)
+{
+    return adc_sum(ch) / ADC_SCANS;
+}
+
+unsigned int adc_read_mv(unsigned int ch)
+{
+    return adc_sum(ch) * VREFINT_MV / adc_sum(ADC_VREFINT);
+}
+
+unsigned int adc_vdda_mv(void)
+{
+    return (4095u * ADC_SCANS * VREFINT_MV) / adc_sum(ADC_VREFINT);
+}
+
+/* Profiling period: about the span of the DMA ring, so that every
+ * conversion is seen. */
+#define PROFILE_PERIOD time_ms(1)
+static struct timer profile_timer;
+static struct adc_profile profile[ADC_NR];
+
+static void profile_add(struct adc_profile *p, unsigned int min,
+                        unsigned int max, unsigned int mean)
+{
+    if (p->nr++ == 0) {
+        p->min = min;
+        p->max = max;
+    } else {
+        p->min = min_t(unsigned int, p->min, min);
+        p->max = max_t(unsigned int, p->max, max);
+    }
+    p->sum += mean;
+}
+
+static void profile_sample(void *unused)
+{
+    uint32_t vref = adc_sum(ADC_VREFINT);
+    unsigned int i, x, lo = ~0u, hi = 0;
+
+    /* VDDA extremes from individual conversions, to catch short dips. The
+     * highest Vrefint reading is the lowest VDDA. */
+    for (i = ADC_VREFINT; i < ARRAY_SIZE(adc_buf); i += ADC_NR) {
+        x = adc_buf[i];
+        lo = min_t(unsigned int, lo, x);
+        hi = max_t(unsigned int, hi, x);
+    }
+    profile_add(&profile[ADC_VREFINT],
+                4095u * VREFINT_MV / hi, 4095u * VREFINT_MV / lo,
+                4095u * ADC_SCANS * VREFINT_MV / vref);
+
+    /* Other channels are profiled from the filtered values. */
+    for (i = 0; i < ADC_NR; i++) {
+        if (i == ADC_VREFINT)
+            continue;
+        x = adc_sum(i) * VREFINT_MV / vref;
+        profile_add(&profile[i], x, x, x);
+    }
+
+    timer_set(&profile_timer, profile_timer.deadline + PROFILE_PERIOD);
+}
+
+void adc_profile_take(struct adc_profile *p)
+{
+    uint32_t oldpri = IRQ_save(TIMER_IRQ_PRI);
+    memcpy(p, profile, sizeof(profile));
+    memset(profile, 0, sizeof(profile));
+    IRQ_restore(oldpri);
+}
+
+void adc_init(void)
+{
+    unsigned int i;
+    uint32_t sqr = 0;
+
+    /* Turn on the peripheral and then wait a while. */
+    rcc->apb2enr |= RCC_APB2ENR_ADC1EN;
+    adc1->cr1 = 0;
+    adc1->cr2 = ADC_CR2_TSVREFE | ADC_CR2_ADON;
+    delay_us(100);
+
+    /* Perform power-on calibration. */
+    adc1->cr2 |= ADC_CR2_RSTCAL;
+    while (adc1->cr2 & ADC_CR2_RSTCAL)
+        continue;
+    adc1->cr2 |= ADC_CR2_CAL;
+    while (adc1->cr2 & ADC_CR2_CAL)
+        continue;
+
+    /* Maximal sample times: the CC dividers are high impedance, and
+     * Vrefint requires at least 17.1us. */
+    adc1->smpr1 = (1u<<24)-1;
+    adc1->smpr2 = (1u<<30)-1;
+
+    /* Regular sequence. */
+    for (i = 0; i < ADC_NR; i++)
+        sqr |= (uint32_t)adc_channels[i] << (i*5);
+    adc1->sqr3 = sqr;
+    adc1->sqr1 = (ADC_NR-1) << 20;
+
+    dma_adc.cpar = (uint32_t)(unsigned long)&adc1->dr;
+    dma_adc.cmar = (uint32_t)(unsigned long)adc_buf;
+    dma_adc.cndtr = ARRAY_SIZE(adc_buf);
+    dma1->ifcr = DMA_IFCR_CGIF(DMA_ADC_CH);
+    dma_adc.ccr = (DMA_CCR_PL_LOW |
+                   DMA_CCR_MSIZE_16BIT |
+                   DMA_CCR_PSIZE_16BIT |
+                   DMA_CCR_MINC |
+                   DMA_CCR_CIRC |
+                   DMA_CCR_DIR_P2M |
+                   DMA_CCR_EN);
+
+    /* Continuous scan. Writing ADON again, with no other change to CR2,
+     * starts conversion. */
+    adc1->cr1 = ADC_CR1_SCAN;
+    adc1->cr2 = ADC_CR2_TSVREFE | ADC_CR2_DMA | ADC_CR2_CONT | ADC_CR2_ADON;
+    adc1->cr2 = ADC_CR2_TSVREFE | ADC_CR2_DMA | ADC_CR2_CONT | ADC_CR2_ADON;
+
+    /* Wait for the ring to fill before anyone reads it. */
+    while (!(dma1->isr & DMA_ISR_TCIF(DMA_ADC_CH)))
+        continue;
+
+    timer_init(&profile_timer, profile_sample, NULL);
+    timer_set(&profile_timer, time_now() + PROFILE_PERIOD);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
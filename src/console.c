@@ -1,7 +1,7 @@
 /*
  * console.c
  * 
- * printf-style interface to USART1.
+ * printf-style interface to USART1, and line input for the command shell.
  * 
  * Written & released by Keir Fraser <keir.xen@gmail.com>
  * 
@@ -11,24 +11,106 @@
 
 #define BAUD 3000000 /* 3Mbaud */
 
+/* Line input is handled at top priority so that the crash key can interrupt
+ * any stuck context. */
+void IRQ_37(void) __attribute__((alias("IRQ_console_rx")));
 #define USART1_IRQ 37
 
-/* Normally flush to serial is asynchronously executed in a low-pri IRQ. */
-void IRQ_44(void) __attribute__((alias("SOFTIRQ_console")));
-#define CONSOLE_SOFTIRQ 44
+/* Reserved key: crash dump of the interrupted context, for debugging. The
+ * dump is produced by the default handler of an unused IRQ, which is
+ * tail-chained so that it sees the interrupted context's frame. Debug builds
+ * only: the dump is printed by printk(), and in a release build the key
+ * would silently reset the jig. */
+#if !defined(NDEBUG)
+#define CRASH_KEY 0x1c /* Ctrl-\ */
+#define CRASH_IRQ 43
+#endif
 
-/* We stage serial output in a ring buffer. */
+/* Normally output is transmitted by DMA, completions handled at low pri.
+ * Producers pend this IRQ to start transmission. */
+void IRQ_14(void) __attribute__((alias("IRQ_console_dma")));
+#define CONSOLE_DMA_IRQ 14
+#define dma_tx (dma1->ch4) /* USART1_TX */
+#define DMA_TX_CH 4
+
+/* We stage serial output in a ring buffer. Producers at any priority
+ * reserve space by advancing resv with cmpxchg, then fill and commit it.
+ * Producers nest strictly by priority, so once the outermost producer
+ * commits, everything up to resv has been written and is published as
+ * prod. Only the consumer advances cons. */
 static char ring[2048];
 #define MASK(x) ((x)&(sizeof(ring)-1))
-static unsigned int cons, prod;
+static volatile unsigned int cons, prod, resv;
+
+/* Producers between reserve and commit. Nested producers restore the count
+ * before the producer they interrupted resumes: no atomics needed. */
+static volatile unsigned int writers;
+
+/* Bytes lost to a full ring, reported in-band by the next producer. */
+static volatile unsigned int dropped;
+
+/* Bytes from ring[cons] currently being transmitted by DMA. */
+static unsigned int dma_len;
 
 /* The console can be set into synchronous mode in which case IRQ is disabled 
  * and the transmit-empty flag is polled manually for each byte. */
 static bool_t sync_console;
 
+/* Line input. A completed line is held until collected by the shell. */
+static char rx_line[64];
+static unsigned int rx_len;
+static volatile bool_t rx_ready;
+
+/* Start DMA from cons up to prod or the end of the ring, whichever is first.
+ * Wrapped output is sent as a second transfer on completion of the first. */
+static void dma_start(void)
+{
+    unsigned int c = MASK(cons);
+
+    dma_len = min_t(unsigned int, prod - cons, sizeof(ring) - c);
+    if (dma_len == 0)
+        return;
+
+    dma_tx.cmar = (uint32_t)(unsigned long)&ring[c];
+    dma_tx.cndtr = dma_len;
+    dma_tx.ccr = (DMA_CCR_MSIZE_8BIT |
+                  DMA_CCR_PSIZE_8BIT |
+                  DMA_CCR_MINC |
+                  DMA_CCR_DIR_M2P |
+                  DMA_CCR_TCIE |
+                  DMA_CCR_EN);
+}
+
+static void dma_complete(void)
+{
+    dma_tx.ccr = 0;
+    dma1->ifcr = DMA_IFCR_CGIF(DMA_TX_CH);
+    cons += dma_len;
+    dma_len = 0;
+}
+
+static void IRQ_console_dma(void)
+{
+    if (dma1->isr & DMA_ISR_TCIF(DMA_TX_CH))
+        dma_complete();
+    if (!sync_console && (dma_len == 0))
+        dma_start();
+}
+
+/* Polled transmit of everything in the ring, for synchronous mode. Must be
+ * called with IRQs disabled. */
 static void flush_ring_to_serial(void)
 {
-    unsigned int c = cons, p = prod;
+    unsigned int c, p;
+
+    /* Let any in-flight DMA finish first. */
+    if (dma_len != 0) {
+        while (!(dma1->isr & DMA_ISR_TCIF(DMA_TX_CH)))
+            cpu_relax();
+        dma_complete();
+    }
+
+    c = cons, p = prod;
     barrier();
 
     while (c != p) {
@@ -41,64 +123,229 @@ static void flush_ring_to_serial(void)
     cons = c;
 }
 
-static void SOFTIRQ_console(void)
-{
-    flush_ring_to_serial();
-}
-
 static void kick_tx(void)
 {
     if (sync_console) {
         flush_ring_to_serial();
-    } else if (cons != prod) {
-        IRQx_set_pending(CONSOLE_SOFTIRQ);
+    } else {
+        IRQx_set_pending(CONSOLE_DMA_IRQ);
     }
 }
 
-int vprintk(const char *format, va_list ap)
+static void add_dropped(unsigned int n)
+{
+    unsigned int d;
+    do {
+        d = dropped;
+    } while (cmpxchg(&dropped, d, d + n) != d);
+}
+
+/* Reserve @len bytes of the ring, and return the ring index of the space in
+ * *@pidx. The space is preceded by a marker if earlier output was dropped.
+ * Returns FALSE, counting the bytes as dropped, if the ring is full. Every
+ * call must be paired with ring_commit(). */
+static bool_t ring_reserve(unsigned int len, unsigned int *pidx)
 {
-    static char str[128];
+    char marker[24];
+    unsigned int r, d, i, mlen = 0;
+
+    writers++;
+    barrier();
+
+    /* Claim the dropped count, to report it ahead of this output. */
+    do {
+        d = dropped;
+    } while (d && (cmpxchg(&dropped, d, 0) != d));
+    if (d)
+        mlen = snprintf(marker, sizeof(marker),
+                        "[%u bytes dropped]\r\n", d);
+
+    do {
+        r = resv;
+        if ((sizeof(ring) - 1 - (r - cons)) < (mlen + len)) {
+            add_dropped(d + len);
+            return FALSE;
+        }
+    } while (cmpxchg(&resv, r, r + mlen + len) != r);
+
+    for (i = 0; i < mlen; i++)
+        ring[MASK(r++)] = marker[i];
+    *pidx = r;
+    return TRUE;
+}
+
+static void ring_commit(void)
+{
+    unsigned int p, r;
+
+    barrier();
+    /* In synchronous mode an interrupted producer may never resume. */
+    if ((--writers != 0) && !sync_console)
+        return;
+
+    /* Outermost producer: publish everything reserved so far. A nested
+     * producer may publish a later value meanwhile: prod never goes back. */
+    do {
+        p = prod;
+        r = resv;
+    } while ((p != r) && (cmpxchg(&prod, p, r) != p));
+
+    kick_tx();
+}
+
+static int console_vprintf(const char *format, va_list ap)
+{
+    char str[128];
+    unsigned int len, idx;
     char *p, c;
     int n;
 
-    IRQ_global_disable();
-
     n = vsnprintf(str, sizeof(str), format, ap);
 
-    p = str;
-    while (((c = *p++) != '\0') && ((prod-cons) != (sizeof(ring) - 1))) {
-        switch (c) {
-        case '\r': /* CR: ignore as we generate our own CR/LF */
-            break;
-        case '\n': /* LF: convert to CR/LF (usual terminal behaviour) */
-            ring[MASK(prod++)] = '\r';
-            /* fall through */
-        default:
-            ring[MASK(prod++)] = c;
-            break;
+    /* CR: ignore as we generate our own CR/LF.
+     * LF: convert to CR/LF (usual terminal behaviour). */
+    for (p = str, len = 0; (c = *p++) != '\0'; )
+        len += (c == '\n') ? 2 : (c != '\r');
+
+    if (ring_reserve(len, &idx)) {
+        for (p = str; (c = *p++) != '\0'; ) {
+            switch (c) {
+            case '\r':
+                break;
+            case '\n':
+                ring[MASK(idx++)] = '\r';
+                /* fall through */
+            default:
+                ring[MASK(idx++)] = c;
+                break;
+            }
         }
     }
+    ring_commit();
 
-    kick_tx();
+    return n;
+}
+
+int console_printf(const char *format, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, format);
+    n = console_vprintf(format, ap);
+    va_end(ap);
+
+    return n;
+}
+
+/* Raw binary output, bypassing the ring and CR/LF conversion. Output is
+ * synchronous, with IRQs disabled. */
+void console_write(const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+
+    IRQ_global_disable();
+
+    /* Flush pending text so that it is not interleaved with the data. */
+    flush_ring_to_serial();
+
+    while (len--) {
+        while (!(usart1->sr & USART_SR_TXE))
+            cpu_relax();
+        usart1->dr = *p++;
+    }
 
     if (!sync_console)
         IRQ_global_enable();
+}
 
-    return n;
+#if !defined(NDEBUG)
+
+int vprintk(const char *format, va_list ap)
+{
+    return console_vprintf(format, ap);
+}
+
+#if defined(TLOG)
+
+/* Tokenized log record: TLOG_SYNC, u16 format ID, u8 nr args, u8 string
+ * mask, then each argument as a u32, or as a u8 length and that many bytes
+ * if a string. Must match scripts/tlog.py. */
+#define TLOG_SYNC 0x1e
+#define TLOG_STR_MAX 64
+
+static unsigned int ring_put(unsigned int idx, const void *buf,
+                             unsigned int len)
+{
+    const uint8_t *p = buf;
+    while (len--)
+        ring[MASK(idx++)] = *p++;
+    return idx;
 }
 
+void tlog(const char *fmt, uint32_t strmask, unsigned int nr, ...)
+{
+    uint8_t hdr[5];
+    const char *s;
+    unsigned int i, len, sz, idx;
+    uint32_t x;
+    va_list ap;
+
+    /* Size the record. Records which do not fit are dropped whole. */
+    sz = sizeof(hdr);
+    va_start(ap, nr);
+    for (i = 0; i < nr; i++) {
+        if (strmask & (1u << i)) {
+            s = va_arg(ap, const char *);
+            sz += 1 + strnlen(s, TLOG_STR_MAX);
+        } else {
+            (void)va_arg(ap, uint32_t);
+            sz += 4;
+        }
+    }
+    va_end(ap);
+
+    hdr[0] = TLOG_SYNC;
+    hdr[1] = (uint32_t)(unsigned long)fmt;
+    hdr[2] = (uint32_t)(unsigned long)fmt >> 8;
+    hdr[3] = nr;
+    hdr[4] = strmask;
+
+    if (ring_reserve(sz, &idx)) {
+        idx = ring_put(idx, hdr, sizeof(hdr));
+        va_start(ap, nr);
+        for (i = 0; i < nr; i++) {
+            if (strmask & (1u << i)) {
+                s = va_arg(ap, const char *);
+                len = strnlen(s, TLOG_STR_MAX);
+                ring[MASK(idx++)] = len;
+                idx = ring_put(idx, s, len);
+            } else {
+                x = va_arg(ap, uint32_t);
+                idx = ring_put(idx, &x, 4);
+            }
+        }
+        va_end(ap);
+    }
+    ring_commit();
+}
+
+#else /* !TLOG */
+
 int printk(const char *format, ...)
 {
     va_list ap;
     int n;
 
     va_start(ap, format);
-    n = vprintk(format, ap);
+    n = console_vprintf(format, ap);
     va_end(ap);
 
     return n;
 }
 
+#endif
+
 void console_sync(void)
 {
     if (sync_console)
@@ -111,6 +358,73 @@ void console_sync(void)
     /* Leave IRQs globally disabled. */
 }
 
+#endif /* !NDEBUG */
+
+static void console_putc(char c)
+{
+    unsigned int idx;
+    if (ring_reserve(1, &idx))
+        ring[MASK(idx)] = c;
+    ring_commit();
+}
+
+static void IRQ_console_rx(void)
+{
+    char c;
+
+    if (!(usart1->sr & (USART_SR_RXNE | USART_SR_ORE)))
+        return;
+    c = usart1->dr; /* clears RXNE and ORE */
+
+#if defined(CRASH_KEY)
+    if (c == CRASH_KEY) {
+        IRQx_set_pending(CRASH_IRQ);
+        return;
+    }
+#endif
+
+    /* Input is ignored until the shell collects the previous line. */
+    if (rx_ready)
+        return;
+
+    switch (c) {
+    case '\r': case '\n':
+        if (rx_len == 0)
+            break;
+        rx_line[rx_len] = '\0';
+        rx_ready = TRUE;
+        console_putc('\r');
+        console_putc('\n');
+        break;
+    case '\b': case 0x7f:
+        if (rx_len == 0)
+            break;
+        rx_len--;
+        console_putc('\b');
+        console_putc(' ');
+        console_putc('\b');
+        break;
+    default:
+        if ((c < 0x20) || (c > 0x7e) || (rx_len >= sizeof(rx_line)-1))
+            break;
+        rx_line[rx_len++] = c;
+        console_putc(c);
+        break;
+    }
+}
+
+bool_t console_getline(char *buf, size_t len)
+{
+    if (!rx_ready)
+        return FALSE;
+
+    snprintf(buf, len, "%s", rx_line);
+    rx_len = 0;
+    barrier();
+    rx_ready = FALSE;
+    return TRUE;
+}
+
 void console_init(void)
 {
     /* Turn on the clocks. */
@@ -123,20 +437,24 @@ void console_init(void)
     /* BAUD, 8n1. */
     usart1->brr = SYSCLK / BAUD;
     usart1->cr1 = USART_CR1_UE | USART_CR1_TE | USART_CR1_RE;
-    usart1->cr3 = 0;
+    usart1->cr3 = USART_CR3_DMAT;
 
-    IRQx_set_prio(CONSOLE_SOFTIRQ, CONSOLE_IRQ_PRI);
-    IRQx_enable(CONSOLE_SOFTIRQ);
-}
+    dma_tx.ccr = 0;
+    dma_tx.cpar = (uint32_t)(unsigned long)&usart1->dr;
+    dma1->ifcr = DMA_IFCR_CGIF(DMA_TX_CH);
 
-/* Debug helper: if we get stuck somewhere, calling this beforehand will cause 
- * any serial input to cause a crash dump of the stuck context. */
-void console_crash_on_input(void)
-{
+    IRQx_set_prio(CONSOLE_DMA_IRQ, CONSOLE_IRQ_PRI);
+    IRQx_enable(CONSOLE_DMA_IRQ);
+
+    /* Line input, and the crash key. */
     (void)usart1->dr; /* clear UART_SR_RXNE */
     usart1->cr1 |= USART_CR1_RXNEIE;
     IRQx_set_prio(USART1_IRQ, RESET_IRQ_PRI);
     IRQx_enable(USART1_IRQ);
+#if defined(CRASH_KEY)
+    IRQx_set_prio(CRASH_IRQ, RESET_IRQ_PRI);
+    IRQx_enable(CRASH_IRQ);
+#endif
 }
 
 /*
@@ -11,6 +11,10 @@
  * Drive 2-digit 7-segment display via a pair of 74HC164 shift registers.
  * SERIAL_DATA=PB10, CLK=PB11.
  * 
+ * After detection at init, display updates are transmitted asynchronously
+ * by a timer callback, one bus transition per step. Frames identical to
+ * what is already displayed are not sent at all.
+ * 
  * Written & released by Keir Fraser <keir.xen@gmail.com>
  * 
  * This is free and unencumbered software released into the public domain.
@@ -37,6 +41,27 @@ static const uint8_t digits[] = {
 
 static uint8_t nr_digits;
 
+/* Asynchronous transmit: each step drives DAT and CLK to a new state. */
+#define TX_STEP_US 5
+#define S_DAT    1 /* DAT HIGH */
+#define S_CLK    2 /* CLK HIGH */
+#define S_SAMPLE 4 /* Sample DAT (TM1651 ACK) before driving */
+#define S_IDLE   (S_DAT|S_CLK)
+
+/* GPIOB register values for each DAT/CLK state, precomputed at init. */
+static uint32_t bus_bsrr[4], bus_crh[4];
+
+static struct timer tx_timer;
+static uint8_t tx_seq[192]; /* TM1651 digits + enable: 180 steps */
+static uint16_t tx_nr, tx_pos;
+static uint8_t tx_retries;
+static bool_t tx_busy, tx_nak;
+
+/* Frame cache: digits 0-2 and display-enable. We transmit only when the
+ * wanted frame differs from what is shown. Protected by TIMER_IRQ_PRI. */
+#define F_ENABLE 3
+static uint8_t tx_want[4], tx_sending[4], tx_shown[4];
+
 
 /*********
  * TM1651 (3-digit) display.
@@ -130,19 +155,66 @@ static bool_t tm1651_send_cmd(uint8_t cmd)
     return fail;
 }
 
-static void tm1651_update_display(const uint8_t *d)
+static void tx_push(uint8_t s)
 {
-    bool_t fail = TRUE;
-    int retry;
+    ASSERT(tx_nr < ARRAY_SIZE(tx_seq));
+    tx_seq[tx_nr++] = s;
+}
 
-    for (retry = 0; fail && (retry < 3); retry++) {
-        tm1651_start();
-        fail = (tm1651_write(0xc0)      /* set addr 0 */
-                || tm1651_write(d[0])   /* dat0 */
-                || tm1651_write(d[1])   /* dat1 */
-                || tm1651_write(d[2])   /* dat2 */
-                || tm1651_write(0x00)); /* dat3 */
-        tm1651_stop();
+/* CLK LOW, leaving DAT as it was. */
+static void tx_push_clk_low(void)
+{
+    tx_push((tx_nr ? tx_seq[tx_nr-1] : S_IDLE) & S_DAT);
+}
+
+static void tm1651_seq_start(void)
+{
+    tx_push_clk_low();
+    tx_push(S_DAT|S_CLK);
+    tx_push(S_CLK);
+}
+
+static void tm1651_seq_stop(void)
+{
+    tx_push_clk_low();
+    tx_push(S_CLK);
+    tx_push(S_DAT|S_CLK);
+}
+
+static void tm1651_seq_write(uint8_t x)
+{
+    unsigned int i;
+    uint8_t d;
+
+    /* As tm1651_write(). */
+    for (i = 0; i < 8; i++) {
+        d = (x >> i) & 1 ? S_DAT : 0;
+        tx_push_clk_low();
+        tx_push(d);
+        tx_push(d|S_CLK);
+    }
+    tx_push_clk_low();
+    tx_push(S_DAT);
+    tx_push(S_SAMPLE); /* sample ACK, then drive DAT LOW */
+    tx_push(S_CLK);
+}
+
+static void tm1651_seq_frame(const uint8_t *d, bool_t new_enable,
+                             bool_t new_digits)
+{
+    if (new_digits) {
+        tm1651_seq_start();
+        tm1651_seq_write(0xc0); /* set addr 0 */
+        tm1651_seq_write(d[0]); /* dat0 */
+        tm1651_seq_write(d[1]); /* dat1 */
+        tm1651_seq_write(d[2]); /* dat2 */
+        tm1651_seq_write(0x00); /* dat3 */
+        tm1651_seq_stop();
+    }
+    if (new_enable) {
+        tm1651_seq_start();
+        tm1651_seq_write(d[F_ENABLE] ? 0x88 + TM1651_BRIGHTNESS : 0x80);
+        tm1651_seq_stop();
     }
 }
 
@@ -162,44 +234,127 @@ static bool_t tm1651_init(void)
  * Shift register (2-digit, 74HC164-based) display.
  */
 
-static void shiftreg_update_display_u16(uint16_t x)
+static void shiftreg_seq_frame(const uint8_t *d)
 {
+    uint16_t x = d[F_ENABLE] ? ((uint16_t)d[0] << 8) | d[1] : 0;
     unsigned int i;
+    uint8_t b;
 
     /* 16 data bits to clock through the pair of 74HC164 registers. 
      * Data is clocked on rising edge of clock. */
     for (i = 0; i < 16; i++) {
-        gpio_write_pin(gpiob, CLK_PIN, LOW);
-        delay_us(CYCLE/4);
-        gpio_write_pin(gpiob, DAT_PIN, (int16_t)x < 0);
-        delay_us(CYCLE/4);
-        gpio_write_pin(gpiob, CLK_PIN, HIGH);
-        delay_us(CYCLE/2);
+        b = ((int16_t)x < 0) ? S_DAT : 0;
+        tx_push_clk_low();
+        tx_push(b);
+        tx_push(b|S_CLK);
         x <<= 1;
     }
 
     /* Leave DAT high at rest, so Gotek's red LED isn't illuminated. */
-    gpio_write_pin(gpiob, DAT_PIN, HIGH);
+    tx_push(S_IDLE);
+}
+
+static void shiftreg_init(void)
+{
+    gpio_configure_pin(gpiob, DAT_PIN, GPO_pushpull(_2MHz, HIGH));
+    gpio_configure_pin(gpiob, CLK_PIN, GPO_pushpull(_2MHz, HIGH));
 }
 
-static uint16_t shiftreg_curval;
 
-static void shiftreg_update_display(const uint8_t *d)
+/*********
+ * Asynchronous transmit.
+ */
+
+/* Precompute register writes for each bus state. DAT/CLK are the only
+ * PB8-15 pins that change configuration after pins_init(), so CRH for the
+ * rest of the port can be captured here. */
+static void tx_init(unsigned int mode_low, unsigned int mode_high)
 {
-    uint16_t x = ((uint16_t)d[0] << 8) | d[1];
-    shiftreg_curval = x;
-    shiftreg_update_display_u16(x);
+    uint32_t crh = gpiob->crh & ~((0xfu << ((DAT_PIN-8)<<2))
+                                  | (0xfu << ((CLK_PIN-8)<<2)));
+    unsigned int s, dat, clk;
+
+    mode_low &= 0xfu;
+    mode_high &= 0xfu;
+    for (s = 0; s < 4; s++) {
+        dat = !!(s & S_DAT);
+        clk = !!(s & S_CLK);
+        bus_bsrr[s] = (((dat ? 0x1u : 0x10000u) << DAT_PIN)
+                       | ((clk ? 0x1u : 0x10000u) << CLK_PIN));
+        bus_crh[s] = (crh
+                      | ((dat ? mode_high : mode_low) << ((DAT_PIN-8)<<2))
+                      | ((clk ? mode_high : mode_low) << ((CLK_PIN-8)<<2)));
+    }
+
+    /* Nothing is known to be displayed yet. */
+    memset(tx_shown, 0xff, sizeof(tx_shown));
 }
 
-static void shiftreg_display_setting(bool_t enable)
+/* Start sending the wanted frame, unless busy or it is already shown.
+ * Caller masks TIMER_IRQ_PRI. */
+static void tx_kick(void)
 {
-    shiftreg_update_display_u16(enable ? shiftreg_curval : 0);
+    bool_t new_digits, new_enable;
+
+    if (tx_busy)
+        return;
+
+    new_digits = (memcmp(tx_want, tx_shown, F_ENABLE) != 0);
+    new_enable = (tx_want[F_ENABLE] != tx_shown[F_ENABLE]);
+    if (!new_digits && !new_enable)
+        return;
+
+    memcpy(tx_sending, tx_want, sizeof(tx_sending));
+    tx_nr = 0;
+    if (nr_digits == 3)
+        tm1651_seq_frame(tx_sending, new_enable, new_digits);
+    else
+        shiftreg_seq_frame(tx_sending);
+
+    tx_pos = 0;
+    tx_retries = 0;
+    tx_nak = FALSE;
+    tx_busy = TRUE;
+    timer_set(&tx_timer, time_now() + time_us(TX_STEP_US));
 }
 
-static void shiftreg_init(void)
+static void tx_step(void *unused)
 {
-    gpio_configure_pin(gpiob, DAT_PIN, GPO_pushpull(_2MHz, HIGH));
-    gpio_configure_pin(gpiob, CLK_PIN, GPO_pushpull(_2MHz, HIGH));
+    uint8_t s = tx_seq[tx_pos++];
+
+    if ((s & S_SAMPLE) && gpio_read_pin(gpiob, DAT_PIN))
+        tx_nak = TRUE;
+    s &= S_DAT|S_CLK;
+    gpiob->bsrr = bus_bsrr[s];
+    gpiob->crh = bus_crh[s];
+
+    if (tx_pos < tx_nr) {
+        timer_set(&tx_timer, time_now() + time_us(TX_STEP_US));
+        return;
+    }
+
+    /* Frame complete. Resend if not ACKed, up to 3 attempts in all. */
+    if (tx_nak && (++tx_retries < 3)) {
+        tx_pos = 0;
+        tx_nak = FALSE;
+        timer_set(&tx_timer, time_now() + time_us(TX_STEP_US));
+        return;
+    }
+
+    memcpy(tx_shown, tx_sending, sizeof(tx_shown));
+    tx_busy = FALSE;
+    tx_kick();
+}
+
+static void tx_update(const uint8_t *d, int enable)
+{
+    uint32_t oldpri = IRQ_save(TIMER_IRQ_PRI);
+    if (d != NULL)
+        memcpy(tx_want, d, F_ENABLE);
+    if (enable >= 0)
+        tx_want[F_ENABLE] = enable;
+    tx_kick();
+    IRQ_restore(oldpri);
 }
 
 
@@ -214,18 +369,12 @@ int led_7seg_nr_digits(void)
 
 void led_7seg_display_setting(bool_t enable)
 {
-    if (nr_digits == 3)
-        tm1651_send_cmd(enable ? 0x88 + TM1651_BRIGHTNESS : 0x80);
-    else
-        shiftreg_display_setting(enable);
+    tx_update(NULL, !!enable);
 }
 
 void led_7seg_write_raw(const uint8_t *d)
 {
-    if (nr_digits == 3)
-        tm1651_update_display(d);
-    else
-        shiftreg_update_display(d);
+    tx_update(d, -1);
 }
 
 void led_7seg_write_string(const char *p)
@@ -262,8 +411,14 @@ void led_7seg_write_decimal(unsigned int val)
 void led_7seg_init(void)
 {
     nr_digits = !tm1651_init() ? 3 : 2;
-    if (nr_digits == 2)
+    if (nr_digits == 3) {
+        /* Simulated open drain, as tm1651_set_pin(). */
+        tx_init(GPO_opendrain(_2MHz, LOW), GPI_pull_up);
+    } else {
         shiftreg_init();
+        tx_init(GPO_pushpull(_2MHz, LOW), GPO_pushpull(_2MHz, HIGH));
+    }
+    timer_init(&tx_timer, tx_step, NULL);
 
     led_7seg_write_string("");
     led_7seg_display_setting(TRUE);
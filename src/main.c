@@ -25,6 +25,82 @@ static uint8_t testmode[] = { CMD_TEST_MODE, 10, 0x4e, 0x4b, 0x50, 0x6e,
                             0xd3, 0x10, 0x29, 0x38 };
 static uint8_t testmodersp[] = { CMD_TEST_MODE, 0 };
 
+/* Expected SELECT and MOTOR pins for each unit on each bus type. */
+static const struct bus_unit {
+    uint8_t bus, unit, sel_pin, mtr_pin;
+} bus_units[] = {
+    { BUS_IBMPC,   0, 14, 10 },
+    { BUS_IBMPC,   1, 12, 16 },
+    { BUS_SHUGART, 0, 10, 16 },
+    { BUS_SHUGART, 1, 12, 16 },
+    { BUS_SHUGART, 2, 14, 16 }
+};
+static int bus_pins[] = { 2, 10, 12, 14, 16 };
+
+static uint8_t gwcmd[16], gwack[2];
+
+/* Bulk throughput test: bytes streamed in each direction, and the slowest
+ * acceptable rate (in kB/s) as seen by the testboard. */
+#define BW_BYTES    (1u << 20)
+#define BW_MIN_KBPS 64
+static uint32_t bwbuf[2048/4];
+
+/* Sink payload is sent as scatter-gather lists of BW_SEGS chunks. At the
+ * slowest acceptable rate a 16kB list completes well within the transmit
+ * timeout. */
+#define BW_SEGS 8
+static CDC_TxSegTypeDef bw_segs[BW_SEGS];
+
+/* USB link quality limits over a whole test run. Transaction errors of any
+ * kind (XactErr, babble, toggle) and stalls should be rare on a good link.
+ * OUT NAKs are limited relative to full-size packets sent; IN NAKs are not
+ * checked, as we poll an idle IN pipe continuously. The limits are fixed,
+ * not derived from the population: a good link is near zero on every
+ * count, and a fixed bar does not drift as marginal boards are passed. */
+#define LNK_MAX_ERRS        2
+#define LNK_MAX_STALLS      0
+#define LNK_MAX_OUT_NAK_PCT 50
+
+/* Run-time settings, adjustable from the console shell. Defaults are the
+ * production limits. */
+static struct {
+    unsigned int pin_passes;   /* States 4-5 and 8-9: passes over all pins */
+    unsigned int bw_min_kbps;
+    unsigned int lnk_max_errs;
+    unsigned int lnk_max_stalls;
+    unsigned int lnk_max_out_nak_pct;
+    unsigned int osc_min, osc_max; /* WDAT period, in SYSCLK ticks */
+    unsigned int cc_min, cc_max;   /* CCn voltage, 12-bit fraction of VDDA */
+    /* VDDA dip below idle, under DUT load. Both are measured against the
+     * typical Vrefint, whose spread scales the dip by up to 3%: a small
+     * error against this limit, unlike the same spread on absolute VDDA. */
+    unsigned int pwr_max_dip_mv;
+    bool_t diag;                   /* Continue after non-fatal failures */
+} settings = {
+    .pin_passes = 12,
+    .bw_min_kbps = BW_MIN_KBPS,
+    .lnk_max_errs = LNK_MAX_ERRS,
+    .lnk_max_stalls = LNK_MAX_STALLS,
+    .lnk_max_out_nak_pct = LNK_MAX_OUT_NAK_PCT,
+    .osc_min = 140, .osc_max = 148,
+    .cc_min = 0x7d8, .cc_max = 0x828,
+    .pwr_max_dip_mv = 100
+};
+
+/* Histogram of WDAT periods across all runs. The first and last bins
+ * collect everything below and above the range. */
+#define OSC_HIST_MIN 136
+#define OSC_HIST_MAX 152
+static uint32_t osc_hist[OSC_HIST_MAX - OSC_HIST_MIN + 3];
+
+/* Power profile of each test step, and idle VDDA measured at the start of
+ * the run. State 3's normal-mode tests are profiled as separate steps. */
+#define NR_STATES 22
+enum { PWR_BUS_TYPES = NR_STATES + 1, PWR_SINK, PWR_SOURCE, PWR_NR };
+static struct adc_profile step_pwr[PWR_NR][ADC_NR];
+static unsigned int pwr_idle_mv;
+static int pwr_step = -1; /* step being profiled */
+
 static uint8_t rspbuf[64];
 static uint16_t dmabuf[32];
 
@@ -35,23 +111,66 @@ struct gw_info gw_info;
 
 static int state = 0;
 
+/* Failures collected in diagnostic mode, reported at the end of the run.
+ * Repeats of the same failure in the same state are counted, not listed. */
+#define MAX_FAULTS 16
+static struct fault {
+    char code[4];
+    int8_t pin;    /* -1 if not a pin fault */
+    uint8_t state;
+    uint16_t count;
+    int32_t value; /* measured value, at first occurrence */
+} faults[MAX_FAULTS];
+static unsigned int nr_faults, faults_dropped;
+
+/* State to (re)start the test sequence from, as requested by the shell. */
+static int run_state;
+
+/* The DUT has been sent CMD_TEST_MODE, and stays in test mode until reset. */
+static bool_t dut_testmode;
+
+/* Progress through the looping test steps. Reset at the start of each run,
+ * so that any step can be re-entered. */
+static struct {
+    unsigned int pin_iter, outer_iter;         /* States 4-5 and 8-10 */
+    unsigned int bus_step, bus_unit, bus_iter; /* test_bus_types() */
+    unsigned int bw_step, bw_restarts;         /* test_bandwidth() */
+    uint32_t bw_todo;
+    time_t bw_time;
+} run;
+
 #define ERR_TX_TIMEOUT      10
 #define ERR_TX_BAD_CALLBACK 11
 #define ERR_RX_TIMEOUT      20
 #define ERR_RX_BAD_CALLBACK 21
+#define ERR_RX_STREAM       22 /* IN stream could not be started */
 #define ERR_BAD_RESPONSE    30
 
+/* A timed-out command is retried after resynchronising the DUT's command
+ * stream via the BAUD_CLEAR_COMMS control channel. Stream payload (commands
+ * with no response) cannot be replayed: the transfer is abandoned instead,
+ * and its owner starts over. */
+#define CMDRSP_MAX_RETRIES 2
+
 enum {
     CMDRSP_IDLE = 0,
     CMDRSP_TX_BUSY,
-    CMDRSP_TX_DONE,
     CMDRSP_RX_BUSY,
-    CMDRSP_RX_DONE
+    CMDRSP_RX_DONE,
+    CMDRSP_RECOVER_CLEAR,  /* SET_LINE_CODING(BAUD_CLEAR_COMMS) */
+    CMDRSP_RECOVER_NORMAL, /* SET_LINE_CODING(BAUD_NORMAL) */
+    CMDRSP_RECOVER_DRAIN,  /* Discard stale IN data */
+    CMDRSP_FAILED          /* Error code in err, raised by the main loop */
 };
 static struct {
+    const CDC_TxSegTypeDef *seg;
+    unsigned int nr_seg;
+    CDC_TxSegTypeDef single; /* segment list of a plain command */
     uint8_t *rsp;
     unsigned int rsp_len;
-    unsigned int state;
+    volatile unsigned int state;
+    unsigned int retries, err;
+    bool_t aborted; /* stream payload abandoned by recovery */
     time_t time;
 } cmdrsp;
 
@@ -74,12 +193,540 @@ static void tone(int hz, int ms)
     }
 }
 
-static void _error(char *s) __attribute__((noreturn));
-static void _error(char *s)
+/* Test-mode steps run in independent groups, which are ordered so that
+ * those that have failed most often run first. */
+static const struct group {
+    uint8_t first, last;
+} groups[] = {
+    {  4,  5 }, /* Drive the GW outputs */
+    {  6,  7 }, /* All pins HIGH */
+    {  8, 10 }, /* Drive the GW inputs */
+    { 11, 12 }, /* All pins LOW */
+    { 13, 14 }, /* Option bytes */
+    { 15, 16 }, /* Test headers */
+    { 17, 18 }, /* WDAT oscillation */
+    { 19, 19 }  /* CCn, and link quality over the whole run: always last */
+};
+#define GRP_LAST (ARRAY_SIZE(groups) - 1)
+#define GRP_DONE_STATE 20
+
+static uint8_t groups_pending, groups_failed; /* bitmaps */
+static int cur_group = -1;
+static bool_t group_end;
+
+/* Persistent results, kept in the flash record store. Each completed run
+ * appends its result. A snapshot of the statistics opens each new page of
+ * the store, so the results in the page to be erased next are accounted
+ * for. At boot the newest snapshot is loaded and the later results are
+ * replayed over it. Types 2 and 4 held earlier result layouts, now
+ * ignored. */
+#define STORE_STATS  1
+#define STORE_BOARD  3
+#define STORE_RESULT 5
+
+/* Failure codes other than pins ("Pnn"), and a catch-all. */
+static const char fail_codes[][4] = {
+    "USB", "OSC", "PWR", "OPT", "HDR", "CCN", "LNK",
+    "E10", "E11", "E20", "E21", "E22", "E30", "???"
+};
+#define NR_PINS 35
+
+static struct jig_stats {
+    uint32_t runs, passes;
+    uint32_t cycle_ms_sum, cycle_ms_min, cycle_ms_max;
+    uint16_t group_fails[ARRAY_SIZE(groups)];
+    uint16_t code_fails[ARRAY_SIZE(fail_codes)];
+    uint16_t pin_fails[NR_PINS];
+    /* Yield split by a board's first run and its retests. */
+    uint32_t first_runs, first_passes;
+    uint32_t retest_runs, retest_passes;
+} stats;
+
+/* Identity of the board under test. It is stored before the board's first
+ * result, which is keyed by a hash of the serial. It is stored again when
+ * the store starts a new page while the board awaits a retest, as its
+ * earlier records may be erased next. */
+static struct board_id {
+    char serial[32];
+    uint16_t vid, pid;
+    struct gw_info info;
+    uint8_t opt[32];
+    uint8_t runs;           /* runs of this board, before this record */
+} board;
+
+/* Recently tested boards, newest first. */
+#define MAX_BOARDS 8
+static struct board_ent {
+    struct board_id id;     /* serial[0] == '\0' if identity unknown */
+    uint16_t key;
+    bool_t failed;          /* last run failed: awaiting a retest */
+} boards[MAX_BOARDS];
+static unsigned int nr_boards;
+
+/* A run's result. Only the listed faults are stored. A fault is identified
+ * by its pin, or by NR_PINS plus its index in fail_codes[]. */
+struct run_result {
+    uint32_t cycle_ms;
+    uint32_t lnk_out_nak;   /* USB link quality over the run */
+    uint16_t lnk_errs;      /* transaction errors of any kind */
+    uint16_t lnk_stalls;
+    uint16_t board_key;
+    uint8_t attempt;        /* 1 = first run of this board */
+    uint8_t groups_failed;  /* bitmap */
+    uint8_t nr_dropped;     /* faults not listed */
+    uint8_t nr_faults;
+    struct {
+        uint8_t id, state;
+    } fault[MAX_FAULTS];
+};
+#define RESULT_LEN(r) (offsetof(struct run_result, fault[(r)->nr_faults]))
+
+static uint64_t run_start;
+static bool_t run_committed;
+static uint32_t stats_seq; /* store_seq() at the newest snapshot */
+
+static void inc_u16(uint16_t *p)
+{
+    if (*p != 0xffff)
+        (*p)++;
+}
+
+/* Copy a result out of the store: records are only 2-byte aligned. */
+static void result_read(struct run_result *r, const void *rec,
+                        unsigned int len)
+{
+    memset(r, 0, sizeof(*r));
+    memcpy(r, rec, min_t(unsigned int, len, sizeof(*r)));
+    r->nr_faults = min_t(unsigned int, r->nr_faults, MAX_FAULTS);
+}
+
+static void fault_name(char *s, unsigned int id)
+{
+    if (id < NR_PINS)
+        snprintf(s, 4, "P%02u", id);
+    else
+        snprintf(s, 4, "%s", fail_codes[min_t(unsigned int, id - NR_PINS,
+                                              ARRAY_SIZE(fail_codes) - 1)]);
+}
+
+/* Account a run's result in the statistics. */
+static void stats_apply(const struct run_result *r)
+{
+    bool_t pass = !r->nr_faults && !r->nr_dropped;
+    unsigned int i, id;
+
+    if (stats.runs++ == 0)
+        stats.cycle_ms_min = stats.cycle_ms_max = r->cycle_ms;
+    stats.cycle_ms_min = min_t(uint32_t, stats.cycle_ms_min, r->cycle_ms);
+    stats.cycle_ms_max = max_t(uint32_t, stats.cycle_ms_max, r->cycle_ms);
+    stats.cycle_ms_sum += r->cycle_ms;
+    if (pass)
+        stats.passes++;
+    if (r->attempt <= 1) {
+        stats.first_runs++;
+        stats.first_passes += pass;
+    } else {
+        stats.retest_runs++;
+        stats.retest_passes += pass;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(groups); i++)
+        if (r->groups_failed & (1u << i))
+            inc_u16(&stats.group_fails[i]);
+    for (i = 0; i < r->nr_faults; i++) {
+        id = r->fault[i].id;
+        if (id < NR_PINS)
+            inc_u16(&stats.pin_fails[id]);
+        else
+            inc_u16(&stats.code_fails[min_t(unsigned int, id - NR_PINS,
+                                            ARRAY_SIZE(fail_codes) - 1)]);
+    }
+}
+
+/* Short key identifying a board in results. 0 if the board is unknown. */
+static uint16_t board_key_of(const struct board_id *id)
+{
+    if (id->serial[0] == '\0')
+        return 0;
+    return crc16_ccitt(id->serial, sizeof(id->serial), 0xffff);
+}
+
+static uint16_t board_key(void)
+{
+    return board_key_of(&board);
+}
+
+static struct board_ent *board_find(uint16_t key)
+{
+    unsigned int i;
+
+    for (i = 0; i < nr_boards; i++)
+        if (boards[i].key == key)
+            return &boards[i];
+    return NULL;
+}
+
+/* Find or add a board's entry, and make it the newest. The oldest entry
+ * makes room if necessary. */
+static struct board_ent *board_get(uint16_t key)
+{
+    struct board_ent e, *b = board_find(key);
+    unsigned int i;
+
+    if (b != NULL) {
+        i = b - boards;
+        e = *b;
+    } else {
+        i = min_t(unsigned int, nr_boards, MAX_BOARDS - 1);
+        nr_boards = i + 1;
+        memset(&e, 0, sizeof(e));
+        e.key = key;
+    }
+    memmove(&boards[1], &boards[0], i * sizeof(e));
+    boards[0] = e;
+    return &boards[0];
+}
+
+/* Count the earlier runs of the board under test. */
+static unsigned int board_prev_runs(void)
+{
+    struct board_ent *b = board_key() ? board_find(board_key()) : NULL;
+    return b ? b->id.runs : 0;
+}
+
+static void stats_init(void)
+{
+    struct store_iter it = { 0 };
+    struct run_result r;
+    struct board_id id;
+    struct board_ent *b;
+    const void *rec;
+    unsigned int len;
+    uint8_t type;
+
+    store_init();
+    stats_seq = store_seq();
+
+    memset(&stats, 0, sizeof(stats));
+    while ((rec = store_next(&it, &type, &len)) != NULL) {
+        switch (type) {
+        case STORE_STATS:
+            /* A snapshot of a different layout cannot be interpreted. */
+            memset(&stats, 0, sizeof(stats));
+            if (len == sizeof(stats))
+                memcpy(&stats, rec, sizeof(stats));
+            break;
+        case STORE_BOARD:
+            memset(&id, 0, sizeof(id));
+            memcpy(&id, rec, min_t(unsigned int, len, sizeof(id)));
+            if (!board_key_of(&id))
+                break;
+            b = board_get(board_key_of(&id));
+            b->id = id;
+            break;
+        case STORE_RESULT:
+            result_read(&r, rec, len);
+            stats_apply(&r);
+            if (!r.board_key)
+                break;
+            b = board_get(r.board_key);
+            b->id.runs = min_t(unsigned int, b->id.runs + 1, 255);
+            b->failed = r.nr_faults || r.nr_dropped;
+            break;
+        }
+    }
+}
+
+/* If the store has started a new page, snapshot the statistics and re-emit
+ * the identities of boards awaiting a retest. Called after all of a run's
+ * records are appended: the snapshot must follow them. */
+static bool_t stats_rollover(void)
+{
+    unsigned int i;
+
+    if (stats_seq == store_seq())
+        return TRUE;
+    stats_seq = store_seq();
+    if (!store_append(STORE_STATS, &stats, sizeof(stats)))
+        return FALSE;
+    /* Oldest first, so that a replay keeps the order. */
+    for (i = nr_boards; i-- != 0; ) {
+        if (!boards[i].failed || (boards[i].id.serial[0] == '\0'))
+            continue;
+        if (!store_append(STORE_BOARD, &boards[i].id, sizeof(boards[i].id)))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static void board_identify(void)
+{
+    struct usb_dut_desc desc;
+
+    usbh_dut_desc(&desc);
+    memset(&board, 0, sizeof(board));
+    memcpy(board.serial, desc.serial, sizeof(board.serial));
+    board.vid = desc.vid;
+    board.pid = desc.pid;
+    board.info = gw_info;
+
+    console_printf("Board %s [%04x], %u previous runs\n",
+                   board.serial, board_key(), board_prev_runs());
+}
+
+/* Plan to run every group after the given state. The group containing that
+ * state, if any, becomes the current group. */
+static void groups_plan(int from)
+{
+    unsigned int g;
+
+    groups_pending = groups_failed = 0;
+    cur_group = -1;
+    for (g = 0; g < ARRAY_SIZE(groups); g++) {
+        if (groups[g].first > from)
+            groups_pending |= 1u << g;
+        else if (groups[g].last >= from)
+            cur_group = g;
+    }
+}
+
+/* Pick the pending group with the most recorded failures, and return its
+ * first state. Ties go to the earlier group. */
+static int next_group(void)
+{
+    unsigned int g;
+    int best = -1;
+
+    for (g = 0; g < GRP_LAST; g++) {
+        if (!(groups_pending & (1u << g)))
+            continue;
+        if ((best < 0)
+            || (stats.group_fails[g] > stats.group_fails[best]))
+            best = g;
+    }
+    if ((best < 0) && (groups_pending & (1u << GRP_LAST)))
+        best = GRP_LAST;
+
+    cur_group = best;
+    if (best < 0)
+        return GRP_DONE_STATE;
+
+    groups_pending &= ~(1u << best);
+    printk("Steps %u-%u (%u previous failures)\n",
+           groups[best].first, groups[best].last,
+           stats.group_fails[best]);
+
+    /* Every group expects the testboard outputs HIGH on entry. */
+    set_pinmask(-1LL);
+    return groups[best].first;
+}
+
+/* Note a failure in the current group. It is counted when the run is
+ * committed. */
+static void group_failed(void)
+{
+    if (cur_group >= 0)
+        groups_failed |= 1u << cur_group;
+}
+
+/* Add a failure to the run's fault list. */
+static void fault_record(const char *code, int pin, int value)
+{
+    struct fault *f;
+    unsigned int i;
+
+    for (i = 0; i < nr_faults; i++) {
+        f = &faults[i];
+        if ((f->state == state) && (f->pin == pin) && !strcmp(f->code, code)) {
+            f->count++;
+            return;
+        }
+    }
+
+    group_failed();
+    if (nr_faults == ARRAY_SIZE(faults)) {
+        faults_dropped++;
+        return;
+    }
+    f = &faults[nr_faults++];
+    snprintf(f->code, sizeof(f->code), "%s", code);
+    f->pin = pin;
+    f->state = state;
+    f->count = 1;
+    f->value = value;
+}
+
+/* Profiled step for a state. State 3 runs the bus-type and bandwidth tests
+ * in turn: their progress tells which is running. */
+static int pwr_step_of(int st)
+{
+    if ((st < 0) || (st >= GRP_DONE_STATE))
+        return -1;
+    if (st != 3)
+        return st;
+    if (run.bus_step < 7)
+        return PWR_BUS_TYPES;
+    if (run.bw_step < 3)
+        return PWR_SINK;
+    if (run.bw_step < 6)
+        return PWR_SOURCE;
+    return st;
+}
+
+/* Fold the power profile since the last call into the given step. Returns
+ * the lowest VDDA seen meanwhile, in mV. */
+static unsigned int pwr_account(int step)
+{
+    struct adc_profile p[ADC_NR], *q;
+    unsigned int i;
+
+    adc_profile_take(p);
+    if ((step < 0) || (step >= PWR_NR))
+        return ~0u;
+
+    for (i = 0; i < ADC_NR; i++) {
+        if (p[i].nr == 0)
+            continue;
+        q = &step_pwr[step][i];
+        if (q->nr == 0) {
+            q->min = p[i].min;
+            q->max = p[i].max;
+        } else {
+            q->min = min_t(unsigned int, q->min, p[i].min);
+            q->max = max_t(unsigned int, q->max, p[i].max);
+        }
+        q->sum += p[i].sum;
+        q->nr += p[i].nr;
+    }
+
+    return p[ADC_VREFINT].nr ? p[ADC_VREFINT].min : ~0u;
+}
+
+/* Clear the profiles for a new run, and take a fresh idle baseline. */
+static void pwr_run_start(void)
+{
+    memset(step_pwr, 0, sizeof(step_pwr));
+    pwr_idle_mv = adc_vdda_mv();
+    pwr_account(-1);
+}
+
+static void pwr_dump(void)
+{
+    static const char *names[ADC_NR] = {
+        [ADC_CC1] = "CC1", [ADC_CC2] = "CC2", [ADC_VREFINT] = "VDDA"
+    };
+    static const char *phases[] = {
+        [PWR_BUS_TYPES - PWR_BUS_TYPES] = "bus",
+        [PWR_SINK - PWR_BUS_TYPES] = "snk",
+        [PWR_SOURCE - PWR_BUS_TYPES] = "src"
+    };
+    const struct adc_profile *p;
+    unsigned int i, j;
+
+    console_printf("Power by step, min/mean/max (mV +/-3%%), idle VDDA %u:\n",
+                   pwr_idle_mv);
+    for (i = 0; i < PWR_NR; i++) {
+        if (step_pwr[i][ADC_VREFINT].nr == 0)
+            continue;
+        if (i < PWR_BUS_TYPES)
+            console_printf(" %5u:", i);
+        else
+            console_printf(" 3.%s:", phases[i - PWR_BUS_TYPES]);
+        for (j = 0; j < ADC_NR; j++) {
+            p = &step_pwr[i][j];
+            console_printf(" %s %u/%u/%u", names[j],
+                           p->min, p->sum / p->nr, p->max);
+        }
+        console_printf("\n");
+    }
+}
+
+/* Transaction errors of any kind on the CDC data pipes. */
+static uint32_t usb_link_errs(const struct usb_link_stats *out,
+                              const struct usb_link_stats *in)
+{
+    return out->xacterr + out->datatglerr
+        + in->xacterr + in->bblerr + in->datatglerr;
+}
+
+/* Account the finished run in the statistics, and append its result to the
+ * store. Once per run. */
+static void run_commit(void)
+{
+    struct run_result r;
+    struct usb_link_stats out, in;
+    struct board_ent *b;
+    const struct fault *f;
+    uint64_t t;
+    unsigned int i, c, attempt;
+    bool_t new_board = FALSE, ok = TRUE;
+
+    if (run_committed)
+        return;
+    run_committed = TRUE;
+
+    /* Power signature of the run, including any step cut short. */
+    pwr_account(pwr_step);
+    pwr_dump();
+
+    attempt = board_prev_runs() + 1;
+
+    memset(&r, 0, sizeof(r));
+    t = time64_now() - run_start;
+    r.cycle_ms = (t >> 32) ? ~0u : (uint32_t)t / time_ms(1);
+    r.board_key = board_key();
+    r.attempt = min_t(unsigned int, attempt, 255);
+    r.groups_failed = groups_failed;
+    r.nr_dropped = min_t(unsigned int, faults_dropped, 255);
+    r.nr_faults = nr_faults;
+    usbh_cdc_link_stats(&out, &in);
+    r.lnk_out_nak = out.nak;
+    r.lnk_errs = min_t(uint32_t, usb_link_errs(&out, &in), 0xffff);
+    r.lnk_stalls = min_t(uint32_t, out.stall + in.stall, 0xffff);
+    for (i = 0; i < nr_faults; i++) {
+        f = &faults[i];
+        if ((f->pin >= 0) && (f->pin < NR_PINS)) {
+            c = f->pin;
+        } else {
+            for (c = 0; c < ARRAY_SIZE(fail_codes) - 1; c++)
+                if (!strcmp(fail_codes[c], f->code))
+                    break;
+            c += NR_PINS;
+        }
+        r.fault[i].id = c;
+        r.fault[i].state = f->state;
+    }
+    stats_apply(&r);
+
+    if (r.board_key) {
+        b = board_find(r.board_key);
+        new_board = (b == NULL) || (b->id.serial[0] == '\0');
+        board.runs = r.attempt - 1;
+        b = board_get(r.board_key);
+        b->id = board;
+        b->id.runs = r.attempt;
+        b->failed = r.nr_faults || r.nr_dropped;
+    }
+
+    console_printf("Result: board %s [%04x] run %u, attempt %u, %s in %u ms\n",
+                   board.serial, r.board_key, stats.runs, attempt,
+                   (nr_faults || faults_dropped) ? "FAIL" : "PASS",
+                   r.cycle_ms);
+
+    if (new_board)
+        ok = store_append(STORE_BOARD, &board, sizeof(board));
+    if (!ok || !store_append(STORE_RESULT, &r, RESULT_LEN(&r))
+        || !stats_rollover())
+        printk("Result store write failed\n");
+}
+
+static void _error(const char *s) __attribute__((noreturn));
+static void _error(const char *s)
 {
     int beeps = 0;
 
     printk("ERROR, state %d: '%s'\n", state, s);
+    run_commit();
 
     for (;;) {
         if (!usbh_cdc_connected())
@@ -102,32 +749,156 @@ static void error(unsigned int nr) __attribute__((noreturn));
 static void error(unsigned int nr)
 {
     char s[4];
+    /* Comms failures: record what happened on the bus. */
+    if ((nr == ERR_TX_TIMEOUT) || (nr == ERR_RX_TIMEOUT))
+        usb_trace_dump();
     snprintf(s, sizeof(s), "E%02u", nr);
+    fault_record(s, -1, nr);
     _error(s);
 }
 
-static void pin_error(unsigned int nr) __attribute__((noreturn));
-static void pin_error(unsigned int nr)
+/* A test failure. Fatal unless in diagnostic mode, when it is recorded and
+ * the run continues. */
+static void fault(const char *code, int pin, int value)
+{
+    fault_record(code, pin, value);
+    if (!settings.diag)
+        _error(code);
+    printk("FAULT, state %d: '%s' (value %d)\n", state, code, value);
+}
+
+static void pin_fault(unsigned int pin, int level)
 {
     char s[4];
-    snprintf(s, sizeof(s), "P%02u", nr);
-    _error(s);
+    snprintf(s, sizeof(s), "P%02u", pin);
+    fault(s, pin, level);
+}
+
+/* Log the fault list, then cycle through it on the display until the DUT
+ * is disconnected. */
+static void faults_report(void) __attribute__((noreturn));
+static void faults_report(void)
+{
+    const struct fault *f;
+    unsigned int i;
+    int beeps = 0;
+
+    run_commit();
+    console_printf("FAILED: %u faults\n", nr_faults + faults_dropped);
+    for (i = 0; i < nr_faults; i++) {
+        f = &faults[i];
+        console_printf(" state %2u: '%s' pin %d value %d (x%u)\n",
+                       f->state, f->code, f->pin, f->value, f->count);
+    }
+    if (faults_dropped)
+        console_printf(" ... %u more not recorded\n", faults_dropped);
+
+    for (;;) {
+        for (i = 0; i < nr_faults; i++) {
+            f = &faults[i];
+            if (!usbh_cdc_connected())
+                system_reset();
+            led_7seg_write_string(f->code);
+            if (beeps < 2) {
+                tone(80, 500);
+                beeps++;
+            } else {
+                delay_ms(500);
+            }
+            led_7seg_write_decimal(f->state);
+            delay_ms(500);
+        }
+    }
+}
+
+/* The callbacks run in the USB softirq (USB_SOFTIRQ_PRI). A response is
+ * requested as soon as its command is sent, irrespective of what the main
+ * loop is doing. The callbacks must not call error(), which never returns:
+ * they fail the command instead, and command_response_handle() raises the
+ * error from the main loop. */
+static void command_fail(unsigned int err)
+{
+    cmdrsp.err = err;
+    cmdrsp.state = CMDRSP_FAILED;
 }
 
 void USBH_CDC_TransmitCallback(void)
 {
-    if (cmdrsp.state != CMDRSP_TX_BUSY)
-        error(ERR_TX_BAD_CALLBACK);
-    cmdrsp.state = CMDRSP_TX_DONE;
+    if (cmdrsp.state != CMDRSP_TX_BUSY) {
+        command_fail(ERR_TX_BAD_CALLBACK);
+        return;
+    }
+    if (cmdrsp.rsp_len == 0) {
+        /* Transmit only. */
+        cmdrsp.state = CMDRSP_IDLE;
+        return;
+    }
+    cmdrsp.state = CMDRSP_RX_BUSY;
+    cmdrsp.time = time_now();
+    USBH_CDC_Receive(rspbuf, cmdrsp.rsp_len);
 }
 
 void USBH_CDC_ReceiveCallback(void)
 {
-    if (cmdrsp.state != CMDRSP_RX_BUSY)
-        error(ERR_RX_BAD_CALLBACK);
+    if (cmdrsp.state == CMDRSP_RECOVER_DRAIN) {
+        /* Stale data: discard it and keep draining. */
+        cmdrsp.time = time_now();
+        USBH_CDC_Receive(rspbuf, sizeof(rspbuf));
+        return;
+    }
+    if (cmdrsp.state != CMDRSP_RX_BUSY) {
+        command_fail(ERR_RX_BAD_CALLBACK);
+        return;
+    }
     cmdrsp.state = CMDRSP_RX_DONE;
 }
 
+/* Runs in USBH_Process context when a SET_LINE_CODING request completes.
+ * As for the transfer callbacks, failures are left to the main loop. */
+void USBH_CDC_LineCodingChanged(void)
+{
+    switch (cmdrsp.state) {
+    case CMDRSP_RECOVER_CLEAR:
+        if (!usbh_cdc_set_baud(BAUD_NORMAL)) {
+            command_fail(cmdrsp.err);
+            break;
+        }
+        cmdrsp.state = CMDRSP_RECOVER_NORMAL;
+        cmdrsp.time = time_now();
+        break;
+    case CMDRSP_RECOVER_NORMAL:
+        cmdrsp.state = CMDRSP_RECOVER_DRAIN;
+        cmdrsp.time = time_now();
+        USBH_CDC_Receive(rspbuf, sizeof(rspbuf));
+        break;
+    }
+}
+
+static void command_submit(void)
+{
+    /* Completion may be signalled as soon as the command is submitted. */
+    cmdrsp.state = CMDRSP_TX_BUSY;
+    cmdrsp.time = time_now();
+    USBH_CDC_TransmitSG(cmdrsp.seg, cmdrsp.nr_seg);
+}
+
+/* Abandon the timed-out command, clear the DUT's command stream, and retry.
+ * Transmit-only commands are not retried here: the owner of the stream
+ * limits its own restarts. */
+static void command_recover(unsigned int err)
+{
+    if (cmdrsp.retries++ >= CMDRSP_MAX_RETRIES)
+        error(err);
+    printk("Comms timeout (E%02u): recovering, attempt %u\n",
+           err, cmdrsp.retries);
+    usbh_cdc_abort();
+    if (!usbh_cdc_set_baud(BAUD_CLEAR_COMMS))
+        error(err);
+    cmdrsp.err = err;
+    cmdrsp.state = CMDRSP_RECOVER_CLEAR;
+    cmdrsp.time = time_now();
+}
+
 static void command_response_handle(void)
 {
     int i;
@@ -135,16 +906,28 @@ static void command_response_handle(void)
     switch (cmdrsp.state) {
     case CMDRSP_TX_BUSY:
         if (time_since(cmdrsp.time) > time_ms(500))
-            error(ERR_TX_TIMEOUT);
-        break;
-    case CMDRSP_TX_DONE:
-        USBH_CDC_Receive(rspbuf, cmdrsp.rsp_len);
-        cmdrsp.state = CMDRSP_RX_BUSY;
-        cmdrsp.time = time_now();
+            command_recover(ERR_TX_TIMEOUT);
         break;
     case CMDRSP_RX_BUSY:
         if (time_since(cmdrsp.time) > time_ms(5000))
-            error(ERR_RX_TIMEOUT);
+            command_recover(ERR_RX_TIMEOUT);
+        break;
+    case CMDRSP_RECOVER_CLEAR:
+    case CMDRSP_RECOVER_NORMAL:
+        if (time_since(cmdrsp.time) > time_ms(500))
+            error(cmdrsp.err);
+        break;
+    case CMDRSP_RECOVER_DRAIN:
+        /* Stream is clean once the DUT has been quiet for a while. */
+        if (time_since(cmdrsp.time) > time_ms(20)) {
+            usbh_cdc_abort();
+            if (cmdrsp.rsp_len != 0) {
+                command_submit();
+            } else {
+                cmdrsp.aborted = TRUE;
+                cmdrsp.state = CMDRSP_IDLE;
+            }
+        }
         break;
     case CMDRSP_RX_DONE:
         if (cmdrsp.rsp && memcmp(rspbuf, cmdrsp.rsp, cmdrsp.rsp_len)) {
@@ -159,18 +942,34 @@ static void command_response_handle(void)
         }
         cmdrsp.state = CMDRSP_IDLE;
         break;
+    case CMDRSP_FAILED:
+        error(cmdrsp.err);
     }
 }
 
+static void command_start(const CDC_TxSegTypeDef *seg, unsigned int nr_seg,
+                          void *rsp, unsigned int rsp_len)
+{
+    cmdrsp.seg = seg;
+    cmdrsp.nr_seg = nr_seg;
+    cmdrsp.rsp = rsp;
+    cmdrsp.rsp_len = rsp_len;
+    cmdrsp.retries = 0;
+    command_submit();
+}
+
 static void command_response(void *cmd, unsigned int cmd_len,
                              void *rsp, unsigned int rsp_len)
 {
-    USBH_CDC_Transmit(cmd, cmd_len);
-    cmdrsp.state = CMDRSP_TX_BUSY;
-    cmdrsp.time = time_now();
+    cmdrsp.single.pbuff = cmd;
+    cmdrsp.single.length = cmd_len;
+    command_start(&cmdrsp.single, 1, rsp, rsp_len);
+}
 
-    cmdrsp.rsp = rsp;
-    cmdrsp.rsp_len = rsp_len;
+/* Send a list of payload buffers as one transfer, expecting no response. */
+static void command_stream(const CDC_TxSegTypeDef *seg, unsigned int nr_seg)
+{
+    command_start(seg, nr_seg, NULL, 0);
 }
 
 static void cmd_led(int state)
@@ -204,7 +1003,7 @@ static void check_pins(int asserted_pin)
         int level = !!(trsp.u.pins[pin/8] & (1<<(pin&7)));
         if (((pin == asserted_pin) && level)
             || ((pin != asserted_pin) && !level))
-            pin_error(pin);
+            pin_fault(pin, level);
     }
 
     for (i = 0; i < ARRAY_SIZE(inp); i++) {
@@ -212,14 +1011,237 @@ static void check_pins(int asserted_pin)
         int level = (mask >> pin) & 1;
         if (((pin == asserted_pin) && level)
             || ((pin != asserted_pin) && !level))
-            pin_error(pin);
+            pin_fault(pin, level);
     }
 }
 
+/* Send a normal-mode Greaseweazle command and expect a plain ACK_OKAY. */
+static void gw_command(uint8_t cmd, unsigned int len)
+{
+    gwcmd[0] = cmd;
+    gwcmd[1] = len;
+    gwack[0] = cmd;
+    gwack[1] = ACK_OKAY;
+    command_response(gwcmd, len, gwack, sizeof(gwack));
+}
+
+static void check_bus_pins(int sel_pin, int mtr_pin)
+{
+    int i;
+    pinmask_t mask = read_pinmask();
+
+    for (i = 0; i < ARRAY_SIZE(bus_pins); i++) {
+        int pin = bus_pins[i];
+        int asserted = (pin == sel_pin) || (pin == mtr_pin);
+        int level = (mask >> pin) & 1;
+        if (asserted == level)
+            pin_fault(pin, level);
+    }
+}
+
+/* Step through SELECT and MOTOR for every unit of both bus types, checking
+ * the floppy-header pins after each command. Each call checks the result of
+ * the previous command and issues the next. Returns FALSE when done. */
+static bool_t test_bus_types(void)
+{
+    const struct bus_unit *u = &bus_units[run.bus_unit];
+    struct gw_delay *d = (struct gw_delay *)&gwcmd[3];
+
+    switch (run.bus_step++) {
+    case 0:
+        /* Short delays: we want back-to-back configurations. */
+        gwcmd[2] = PARAMS_DELAYS;
+        d->select_delay = 10;
+        d->step_delay = 3000;
+        d->seek_settle = 15;
+        d->motor_delay = 0;
+        d->watchdog = 10000;
+        gw_command(CMD_SET_PARAMS, 3 + sizeof(*d));
+        break;
+    case 1:
+        check_bus_pins(-1, -1);
+        gwcmd[2] = u->bus;
+        gw_command(CMD_SET_BUS_TYPE, 3);
+        break;
+    case 2:
+        check_bus_pins(-1, -1);
+        gwcmd[2] = u->unit;
+        gw_command(CMD_SELECT, 3);
+        break;
+    case 3:
+        check_bus_pins(u->sel_pin, -1);
+        gwcmd[2] = u->unit;
+        gwcmd[3] = 1;
+        gw_command(CMD_MOTOR, 4);
+        break;
+    case 4:
+        check_bus_pins(u->sel_pin, u->mtr_pin);
+        gwcmd[2] = u->unit;
+        gwcmd[3] = 0;
+        gw_command(CMD_MOTOR, 4);
+        break;
+    case 5:
+        check_bus_pins(u->sel_pin, -1);
+        gw_command(CMD_DESELECT, 2);
+        break;
+    case 6:
+        check_bus_pins(-1, -1);
+        run.bus_step = 1;
+        if (++run.bus_unit < ARRAY_SIZE(bus_units))
+            break;
+        run.bus_unit = 0;
+        if (++run.bus_iter < 4)
+            break;
+        /* Back to default parameters and no bus. */
+        run.bus_step = 7;
+        gw_command(CMD_RESET, 2);
+        break;
+    default:
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Throughput in kB/s (bytes per millisecond). Scale down to avoid overflow:
+ * we have no 64-bit division. */
+static unsigned int kbps(uint32_t bytes, uint32_t usecs)
+{
+    while (bytes > 0xffffffffu/1000) {
+        bytes >>= 1;
+        usecs >>= 1;
+    }
+    return usecs ? (bytes * 1000) / usecs : 0;
+}
+
+static void check_bandwidth(const char *dir, time_t t)
+{
+    struct gw_bw_stats bw;
+    unsigned int jig, dut_min, dut_max;
+
+    if ((rspbuf[0] != CMD_GET_INFO) || (rspbuf[1] != ACK_OKAY))
+        error(ERR_BAD_RESPONSE);
+    memcpy(&bw, rspbuf+2, sizeof(bw));
+
+    jig = kbps(BW_BYTES, t / TIME_MHZ);
+    dut_min = kbps(bw.min_bw.bytes, bw.min_bw.usecs);
+    dut_max = kbps(bw.max_bw.bytes, bw.max_bw.usecs);
+    printk("USB %s: %u kB/s (DUT min %u, max %u)\n",
+           dir, jig, dut_min, dut_max);
+
+    /* We must achieve a sane rate, and it must be consistent with the
+     * DUT's own measurements (allowing 25% for differing windows). */
+    if ((jig < settings.bw_min_kbps) || (jig > dut_max + dut_max/4))
+        fault("USB", -1, jig);
+}
+
+/* Stream BW_BYTES to the DUT (pseudo-random payload) and then from the DUT,
+ * timing each direction and cross-checking against the DUT's GETINFO_BW_STATS.
+ * Like test_bus_types(), each call issues the next command or transfer.
+ * Returns FALSE when done. */
+static bool_t test_bandwidth(void)
+{
+    struct gw_sink_source_bytes *ssb = (struct gw_sink_source_bytes *)
+        &gwcmd[2];
+    unsigned int i, len;
+
+    /* A transfer timed out and the DUT's command stream has been cleared:
+     * start over. */
+    if (cmdrsp.aborted) {
+        cmdrsp.aborted = FALSE;
+        if (run.bw_restarts++ >= CMDRSP_MAX_RETRIES)
+            error(cmdrsp.err);
+        run.bw_step = 0;
+    }
+
+    switch (run.bw_step++) {
+    case 0:
+        ssb->nr_bytes = run.bw_todo = BW_BYTES;
+        gw_command(CMD_SINK_BYTES, 2 + sizeof(*ssb));
+        run.bw_time = time_now();
+        break;
+    case 1:
+        /* Regenerate the chunk for each list. The DUT does not verify the
+         * payload, so repeats within a list do not matter, and sending many
+         * chunks per round trip keeps our main loop out of the figure. */
+        for (i = 0; i < ARRAY_SIZE(bwbuf); i++)
+            bwbuf[i] = rand();
+        for (i = 0; (i < ARRAY_SIZE(bw_segs)) && (run.bw_todo != 0); i++) {
+            len = min_t(uint32_t, run.bw_todo, sizeof(bwbuf));
+            bw_segs[i].pbuff = (uint8_t *)bwbuf;
+            bw_segs[i].length = len;
+            run.bw_todo -= len;
+        }
+        command_stream(bw_segs, i);
+        if (run.bw_todo != 0)
+            run.bw_step--;
+        break;
+    case 2:
+        run.bw_time = time_since(run.bw_time);
+        gwcmd[0] = CMD_GET_INFO;
+        gwcmd[1] = 3;
+        gwcmd[2] = GETINFO_BW_STATS;
+        command_response(gwcmd, 3, NULL, 34);
+        break;
+    case 3:
+        check_bandwidth("sink", run.bw_time);
+        /* Receive the ACK and the data stream into a ring: the ACK may
+         * share a packet with the start of the data. */
+        if (USBH_CDC_StreamStart((uint8_t *)bwbuf, sizeof(bwbuf)) != USBH_OK)
+            error(ERR_RX_STREAM);
+        ssb->nr_bytes = BW_BYTES;
+        gwcmd[0] = CMD_SOURCE_BYTES;
+        gwcmd[1] = 2 + sizeof(*ssb);
+        command_response(gwcmd, gwcmd[1], NULL, 0);
+        run.bw_todo = 2 + BW_BYTES;
+        run.bw_time = cmdrsp.time = time_now();
+        break;
+    case 4: {
+        uint8_t *p;
+        uint32_t avail;
+        while ((p = USBH_CDC_StreamPeek(&avail)) != NULL) {
+            if ((run.bw_todo == 2 + BW_BYTES)
+                && ((avail < 2) || (p[0] != CMD_SOURCE_BYTES)
+                    || (p[1] != ACK_OKAY)))
+                error(ERR_BAD_RESPONSE);
+            if (avail > run.bw_todo)
+                error(ERR_BAD_RESPONSE);
+            run.bw_todo -= avail;
+            USBH_CDC_StreamConsume(avail);
+            cmdrsp.time = time_now();
+        }
+        if (USBH_CDC_StreamError())
+            error(ERR_BAD_RESPONSE);
+        if (run.bw_todo != 0) {
+            if (time_since(cmdrsp.time) > time_ms(5000))
+                command_recover(ERR_RX_TIMEOUT);
+            run.bw_step--;
+            break;
+        }
+        USBH_CDC_StreamStop();
+        break;
+    }
+    case 5:
+        run.bw_time = time_since(run.bw_time);
+        gwcmd[0] = CMD_GET_INFO;
+        gwcmd[1] = 3;
+        gwcmd[2] = GETINFO_BW_STATS;
+        command_response(gwcmd, 3, NULL, 34);
+        break;
+    case 6:
+        check_bandwidth("source", run.bw_time);
+        /* fall through */
+    default:
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
 /* Confirm that WDAT is oscillating at 500kHz. */
 static void test_wdat_osc(void)
 {
-    int i;
+    int i, missing;
 
     /* Take timestamps of WDAT falling edges. */
     tim1->psc = 0;
@@ -244,8 +1266,7 @@ static void test_wdat_osc(void)
 
     /* Wait for DMA buffer to fill, and confirm the buffer is indeed full. */
     delay_ms(1);
-    if (!(dma1->isr & DMA_ISR_TCIF(2)))
-        _error("OSC");
+    missing = (dma1->isr & DMA_ISR_TCIF(2)) ? 0 : dma1->ch2.cndtr;
 
     /* Turn off timer and DMA. */
     tim1->ccer = 0;
@@ -253,72 +1274,357 @@ static void test_wdat_osc(void)
     tim1->sr = 0;
     dma1->ch2.ccr = 0;
 
+    if (missing) {
+        fault("OSC", -1, -missing);
+        return;
+    }
+
     /* Check that time intervals are all 2us +/- 2.5% (55ns) */
     printk("Times: ");
     for (i = ARRAY_SIZE(dmabuf)-1; i > 0; i--) {
         uint16_t x = dmabuf[i] - dmabuf[i-1];
         printk("%d ", x);
+        osc_hist[(x < OSC_HIST_MIN) ? 0
+                 : (x > OSC_HIST_MAX) ? ARRAY_SIZE(osc_hist) - 1
+                 : x - OSC_HIST_MIN + 1]++;
         /* Very liberal bounds check. */
-        if ((x < 140) || (x > 148))
-            _error("OSC");
+        if ((x < settings.osc_min) || (x > settings.osc_max))
+            fault("OSC", -1, x);
     }
     printk("\n");
 }
 
-static void adc_init(void)
+static bool_t test_usb_cc(void)
 {
-    /* Turn on the peripheral and then wait a while. */
-    rcc->apb2enr |= RCC_APB2ENR_ADC1EN;
-    adc1->cr1 = 0;
-    adc1->cr2 = ADC_CR2_ADON;
-    delay_us(100);
+    unsigned int i, val;
 
-    /* Perform power-on calibration. */
-    adc1->cr2 |= ADC_CR2_RSTCAL;
-    while (adc1->cr2 & ADC_CR2_RSTCAL)
-        continue;
-    adc1->cr2 |= ADC_CR2_CAL;
-    while (adc1->cr2 & ADC_CR2_CAL)
-        continue;
+    /* Filtered CC1 and CC2 values from pins PA0 and PA1. */
+    for (i = ADC_CC1; i <= ADC_CC2; i++) {
+        val = adc_read(i);
+        printk("CC%u: %u (%u mV)\n", i - ADC_CC1 + 1, val, adc_read_mv(i));
+        /* Looking for Vdd/2 +/- 2% on the connected CC line. */
+        if ((val >= settings.cc_min) && (val <= settings.cc_max))
+            return TRUE;
+    }
 
-    /* Maximal sample times as we are in no hurry. */
-    adc1->smpr1 = (1u<<24)-1;
-    adc1->smpr2 = (1u<<30)-1;
+    return FALSE;
 }
 
-static int adc_convert_channel(unsigned int n)
+/* Check link quality, returning the count of transaction errors. */
+static bool_t test_usb_link(uint32_t *perrs)
 {
-    /* One conversion: Channel n */
-    adc1->sr = 0;
-    adc1->sqr3 = n;
-    adc1->sqr1 = 0;
-    adc1->cr2 |= ADC_CR2_ADON;
-    while (!(adc1->sr & ADC_SR_EOC))
-        continue;
-    return adc1->dr & 0xfff;
+    struct usb_link_stats out, in;
+    uint32_t errs;
+
+    usbh_cdc_link_stats(&out, &in);
+    console_printf("USB OUT: %u bytes, %u NAK, %u retries, %u xacterr, "
+                   "%u dtglerr, %u stall\n",
+                   out.bytes, out.nak, out.retries, out.xacterr,
+                   out.datatglerr, out.stall);
+    console_printf("USB IN: %u bytes, %u NAK, %u retries, %u xacterr, "
+                   "%u bblerr, %u dtglerr, %u stall\n",
+                   in.bytes, in.nak, in.retries, in.xacterr,
+                   in.bblerr, in.datatglerr, in.stall);
+
+    errs = usb_link_errs(&out, &in);
+    *perrs = errs;
+    return ((errs <= settings.lnk_max_errs)
+            && ((out.stall + in.stall) <= settings.lnk_max_stalls)
+            && (out.nak <= ((out.bytes / 64)
+                            * settings.lnk_max_out_nak_pct / 100)));
 }
 
-static bool_t test_usb_cc(void)
+/* Check for brown-out over a step just finished, if the DUT was under heavy
+ * load: streaming, and driving all outputs LOW. */
+static void pwr_step_end(void)
 {
-    int i, val;
+    int step = pwr_step;
+    unsigned int mv = pwr_account(step);
+
+    pwr_step = -1;
+    if ((step != PWR_SINK) && (step != PWR_SOURCE)
+        && (step != 11) && (step != 12))
+        return;
+    if (mv + settings.pwr_max_dip_mv < pwr_idle_mv) {
+        printk("VDDA dip to %u mV (idle %u mV)\n", mv, pwr_idle_mv);
+        fault("PWR", -1, mv);
+    }
+}
 
-    /* Grab CC1 and CC2 values from pins PA0 and PA1. */
-    for (i = 0; i < 2; i++) {
-        val = adc_convert_channel(i);
-        /* Looking for Vdd/2 +/- 2% on the connected CC line. */
-        if ((val >= 0x7d8) && (val <= 0x828))
-            return TRUE;
+/*
+ * Console command shell. Lines are collected by the USART RX interrupt and
+ * executed here, from the main loop, between test steps.
+ */
+
+static const struct tolerance {
+    const char *name;
+    unsigned int *p;
+} tolerances[] = {
+    { "bw_min_kbps", &settings.bw_min_kbps },
+    { "lnk_max_errs", &settings.lnk_max_errs },
+    { "lnk_max_stalls", &settings.lnk_max_stalls },
+    { "lnk_max_out_nak_pct", &settings.lnk_max_out_nak_pct },
+    { "osc_min", &settings.osc_min },
+    { "osc_max", &settings.osc_max },
+    { "cc_min", &settings.cc_min },
+    { "cc_max", &settings.cc_max },
+    { "pwr_max_dip_mv", &settings.pwr_max_dip_mv },
+};
+
+static bool_t parse_uint(const char *s, unsigned int *p)
+{
+    char *end;
+    long int x = strtol(s, &end, 0);
+    if ((*s == '\0') || (*end != '\0') || (x < 0))
+        return FALSE;
+    *p = x;
+    return TRUE;
+}
+
+static void shell_help(int argc, char **argv);
+
+static void shell_iterations(int argc, char **argv)
+{
+    unsigned int n;
+    if ((argc > 1) && (!parse_uint(argv[1], &n) || (n == 0))) {
+        console_printf("Bad iteration count '%s'\n", argv[1]);
+        return;
     }
+    if (argc > 1)
+        settings.pin_passes = n;
+    console_printf("Pin test passes: %u\n", settings.pin_passes);
+}
 
-    return FALSE;
+static void shell_tolerances(int argc, char **argv)
+{
+    const struct tolerance *t;
+    unsigned int i;
+
+    if (argc == 1) {
+        for (i = 0; i < ARRAY_SIZE(tolerances); i++) {
+            t = &tolerances[i];
+            console_printf(" %20s %u\n", t->name, *t->p);
+        }
+        return;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(tolerances); i++)
+        if (!strcmp_ci(argv[1], tolerances[i].name))
+            break;
+    if (i == ARRAY_SIZE(tolerances)) {
+        console_printf("Unknown tolerance '%s'\n", argv[1]);
+        return;
+    }
+    t = &tolerances[i];
+    if ((argc > 2) && !parse_uint(argv[2], t->p)) {
+        console_printf("Bad value '%s'\n", argv[2]);
+        return;
+    }
+    console_printf(" %20s %u\n", t->name, *t->p);
+}
+
+static void shell_diag(int argc, char **argv)
+{
+    if (argc > 1) {
+        if (!strcmp_ci(argv[1], "on")) {
+            settings.diag = TRUE;
+        } else if (!strcmp_ci(argv[1], "off")) {
+            settings.diag = FALSE;
+        } else {
+            console_printf("Expected 'on' or 'off'\n");
+            return;
+        }
+    }
+    console_printf("Diagnostic mode: %s\n", settings.diag ? "on" : "off");
+}
+
+static void shell_results(int argc, char **argv)
+{
+    struct run_result r;
+    struct store_iter it = { 0 };
+    const void *rec;
+    unsigned int i, n, len;
+    uint8_t type;
+    char code[4];
+
+    if ((argc > 1) && !strcmp_ci(argv[1], "clear")) {
+        store_erase();
+        memset(&stats, 0, sizeof(stats));
+        nr_boards = 0;
+        console_printf("Results cleared\n");
+        return;
+    }
+
+    console_printf("Runs: %u, passed %u\n", stats.runs, stats.passes);
+    console_printf("First runs: %u, passed %u; retests: %u, passed %u\n",
+                   stats.first_runs, stats.first_passes,
+                   stats.retest_runs, stats.retest_passes);
+    if (stats.runs)
+        console_printf("Cycle time min/mean/max (ms): %u/%u/%u\n",
+                       stats.cycle_ms_min, stats.cycle_ms_sum / stats.runs,
+                       stats.cycle_ms_max);
+    console_printf("Failures by steps:");
+    for (i = 0; i < ARRAY_SIZE(groups); i++)
+        console_printf(" %u-%u:%u", groups[i].first, groups[i].last,
+                       stats.group_fails[i]);
+    console_printf("\nFailures by code:");
+    for (i = 0; i < ARRAY_SIZE(fail_codes); i++)
+        if (stats.code_fails[i])
+            console_printf(" %s:%u", fail_codes[i], stats.code_fails[i]);
+    for (i = 0; i < NR_PINS; i++)
+        if (stats.pin_fails[i])
+            console_printf(" P%02u:%u", i, stats.pin_fails[i]);
+    console_printf("\nLog, oldest first:\n");
+
+    /* Runs are numbered back from the total: older results were erased. */
+    n = 0;
+    while ((rec = store_next(&it, &type, &len)) != NULL)
+        if (type == STORE_RESULT)
+            n++;
+    n = stats.runs - min_t(unsigned int, n, stats.runs);
+
+    memset(&it, 0, sizeof(it));
+    while ((rec = store_next(&it, &type, &len)) != NULL) {
+        if (type != STORE_RESULT)
+            continue;
+        result_read(&r, rec, len);
+        console_printf(" #%u [%04x/%u]: %u ms, link %u err %u NAK %u stall, "
+                       "%s", ++n, r.board_key, r.attempt, r.cycle_ms,
+                       r.lnk_errs, r.lnk_out_nak, r.lnk_stalls,
+                       (r.nr_faults || r.nr_dropped) ? "FAIL" : "PASS");
+        for (i = 0; i < r.nr_faults; i++) {
+            fault_name(code, r.fault[i].id);
+            console_printf(" %s@%u", code, r.fault[i].state);
+        }
+        if (r.nr_dropped)
+            console_printf(" +%u", r.nr_dropped);
+        console_printf("\n");
+    }
+}
+
+static void shell_stats(int argc, char **argv)
+{
+    struct usb_link_stats out, in;
+    unsigned int i;
+
+    timer_stats_dump();
+    pwr_dump();
+
+    usbh_cdc_link_stats(&out, &in);
+    console_printf("USB OUT: %u bytes, %u NAK, %u errs, %u stall\n",
+                   out.bytes, out.nak,
+                   out.xacterr + out.datatglerr, out.stall);
+    console_printf("USB IN: %u bytes, %u NAK, %u errs, %u stall\n",
+                   in.bytes, in.nak,
+                   in.xacterr + in.bblerr + in.datatglerr, in.stall);
+
+    console_printf("WDAT periods (ticks):\n");
+    for (i = 0; i < ARRAY_SIZE(osc_hist); i++) {
+        if (i == 0)
+            console_printf("  <%u", OSC_HIST_MIN);
+        else if (i == ARRAY_SIZE(osc_hist) - 1)
+            console_printf("  >%u", OSC_HIST_MAX);
+        else
+            console_printf("  %3u", OSC_HIST_MIN + i - 1);
+        console_printf(": %u\n", osc_hist[i]);
+    }
+}
+
+static void shell_bench(int argc, char **argv)
+{
+#if defined(BENCH)
+    timer_bench();
+#else
+    console_printf("Not built with bench=y\n");
+#endif
+}
+
+/* Before test mode only a full run can be started, from state 1. In test
+ * mode the sequence restarts at the first state of a group: each group
+ * starts by issuing a command, and later states check its response. */
+static void shell_run(int argc, char **argv)
+{
+    unsigned int g, n = dut_testmode ? groups[0].first : 1;
+
+    if (argc > 1) {
+        if (!parse_uint(argv[1], &n))
+            n = 0;
+        for (g = 0; g < ARRAY_SIZE(groups); g++)
+            if (groups[g].first == n)
+                break;
+        if (dut_testmode ? (g == ARRAY_SIZE(groups)) : (n != 1)) {
+            console_printf("Cannot run from state '%s'\n", argv[1]);
+            return;
+        }
+    }
+    run_state = n;
+}
+
+static const struct shell_cmd {
+    const char *name, *args, *help;
+    void (*fn)(int argc, char **argv);
+} shell_cmds[] = {
+    { "help", "", "List commands", shell_help },
+    { "iterations", "[n]", "Show/set pin test passes", shell_iterations },
+    { "tolerances", "[name [value]]", "Show/set test limits",
+      shell_tolerances },
+    { "diag", "[on|off]", "Continue after test failures",
+      shell_diag },
+    { "results", "[clear]", "Stored statistics and result log",
+      shell_results },
+    { "stats", "", "Timer, power, USB link and WDAT statistics",
+      shell_stats },
+    { "bench", "", "Run the timer benchmark", shell_bench },
+    { "run", "[state]", "Rerun tests, optionally from a group's first state",
+      shell_run },
+};
+
+static void shell_help(int argc, char **argv)
+{
+    const struct shell_cmd *c;
+    unsigned int i;
+    for (i = 0; i < ARRAY_SIZE(shell_cmds); i++) {
+        c = &shell_cmds[i];
+        console_printf(" %10s %16s %s\n", c->name, c->args, c->help);
+    }
+}
+
+static void shell_process(void)
+{
+    char line[64], *argv[4], *p;
+    int argc = 0;
+    unsigned int i;
+
+    if (!console_getline(line, sizeof(line)))
+        return;
+
+    /* Split into whitespace-separated arguments. */
+    for (p = line; *p != '\0';) {
+        while (isspace(*p))
+            *p++ = '\0';
+        if ((*p == '\0') || (argc == ARRAY_SIZE(argv)))
+            break;
+        argv[argc++] = p;
+        while ((*p != '\0') && !isspace(*p))
+            p++;
+    }
+    if (argc == 0)
+        return;
+
+    for (i = 0; i < ARRAY_SIZE(shell_cmds); i++) {
+        if (!strcmp_ci(argv[0], shell_cmds[i].name)) {
+            (*shell_cmds[i].fn)(argc, argv);
+            return;
+        }
+    }
+    console_printf("Unknown command '%s': try 'help'\n", argv[0]);
 }
 
 int main(void)
 {
-    int pin_iter = 0;
-    int outer_iter = 0;
     int success = FALSE;
     int beeps = 0;
+    bool_t hub = FALSE;
 
     /* Relocate DATA. Initialise BSS. */
     if (&_sdat[0] != &_ldat[0])
@@ -328,8 +1634,8 @@ int main(void)
     stm32_init();
     time_init();
     console_init();
-    console_crash_on_input();
     pins_init();
+    stats_init();
     tone_init();
 
     /* Power on: 5v settle for 200ms while sounding a 2kHz double beep on the
@@ -349,15 +1655,27 @@ int main(void)
 
     adc_init();
 
+#if defined(BENCH)
+    usb_fifo_bench();
+    timer_bench();
+#endif
+
     usbh_cdc_init();
     usbh_cdc_buffer_set((void *)usbh_buf);
     led_7seg_write_string("USB");
 
     for (;;) {
+        shell_process();
         usbh_cdc_process();
         if (!usbh_cdc_connected()) {
             if (state || cmdrsp.state)
                 system_reset();
+            if (usbh_hub_attached() != hub) {
+                /* Only one DUT can be tested at a time: direct connection
+                 * to the jig is required. */
+                hub = !hub;
+                led_7seg_write_string(hub ? "HUB" : "USB");
+            }
             continue;
         }
         if (cmdrsp.state) {
@@ -365,11 +1683,43 @@ int main(void)
             continue;
         }
 
+        /* Close the power profile of a step which is ending. */
+        if (!run_state && (pwr_step >= 0)
+            && (group_end || (pwr_step_of(state + 1) != pwr_step)))
+            pwr_step_end();
+
+        if (run_state) {
+            pwr_run_start();
+            pwr_step = -1;
+            nr_faults = faults_dropped = 0;
+            run_start = time64_now();
+            run_committed = FALSE;
+            groups_plan(run_state);
+            group_end = FALSE;
+            state = run_state - 1;
+            run_state = 0;
+            memset(&run, 0, sizeof(run));
+            success = FALSE;
+            beeps = 0;
+        }
+
+        if (group_end) {
+            group_end = FALSE;
+            state = next_group() - 1;
+        }
+
         state++;
+        if (pwr_step < 0)
+            pwr_step = pwr_step_of(state);
         if (!success)
             led_7seg_write_decimal(state);
         switch (state) {
         case 1:
+            pwr_run_start();
+            run_start = time64_now();
+            run_committed = FALSE;
+            memset(&board, 0, sizeof(board));
+            memset(&run, 0, sizeof(run));
             command_response(info, sizeof(info),
                              NULL, 34);
             break;
@@ -381,28 +1731,37 @@ int main(void)
             if ((gw_info.max_cmd < CMD_MAX)
                 || !gw_info.is_main_firmware)
                 error(ERR_BAD_RESPONSE);
+            board_identify();
             break;
         }
         case 3:
+            /* Normal-mode tests must run before we enter test mode. */
+            if (test_bus_types() || test_bandwidth()) {
+                state = 3-1; /* loop */
+                break;
+            }
             command_response(testmode, sizeof(testmode),
                              testmodersp, sizeof(testmodersp));
+            dut_testmode = TRUE;
+            groups_plan(3);
+            group_end = TRUE;
             break;
 
             /* Drive the GW outputs (testboard inputs) one by one. */
         case 4:
-            if (pin_iter >= ARRAY_SIZE(inp)) {
-                pin_iter = 0;
-                if (outer_iter++ > 10) {
-                    outer_iter = 0;
-                    state = 6-1; /* break */
+            if (run.pin_iter >= ARRAY_SIZE(inp)) {
+                run.pin_iter = 0;
+                if (++run.outer_iter >= settings.pin_passes) {
+                    run.outer_iter = 0;
+                    group_end = TRUE; /* break */
                     break;
                 }
             }
-            cmd_set_pin(inp[pin_iter]);
+            cmd_set_pin(inp[run.pin_iter]);
             break;
         case 5:
-            check_pins(inp[pin_iter]);
-            pin_iter++;
+            check_pins(inp[run.pin_iter]);
+            run.pin_iter++;
             state = 4-1; /* loop */
             break;
 
@@ -412,26 +1771,27 @@ int main(void)
             break;
         case 7:
             check_pins(-1);
+            group_end = TRUE;
             break;
 
             /* Drive the GW inputs (testboard outputs) one by one. */
         case 8:
-            if (pin_iter >= ARRAY_SIZE(outp)) {
-                pin_iter = 0;
-                if (outer_iter++ > 10) {
-                    outer_iter = 0;
-                    state = 11-1; /* break */
+            if (run.pin_iter >= ARRAY_SIZE(outp)) {
+                run.pin_iter = 0;
+                if (++run.outer_iter >= settings.pin_passes) {
+                    run.outer_iter = 0;
+                    group_end = TRUE; /* break */
                     break;
                 }
             }
-            set_pinmask(-1LL & ~(1ull << outp[pin_iter]));
+            set_pinmask(-1LL & ~(1ull << outp[run.pin_iter]));
             break;
         case 9:
             cmd_set_pin(-1);
             break;
         case 10:
-            check_pins(outp[pin_iter]);
-            pin_iter++;
+            check_pins(outp[run.pin_iter]);
+            run.pin_iter++;
             state = 8-1; /* loop */
             break;
 
@@ -453,14 +1813,15 @@ int main(void)
                 int pin = outp[i];
                 int level = !!(trsp.u.pins[pin/8] & (1<<(pin&7)));
                 if (level)
-                    pin_error(pin);
+                    pin_fault(pin, level);
             }
             for (i = 0; i < ARRAY_SIZE(inp); i++) {
                 int pin = inp[i];
                 int level = (mask >> pin) & 1;
                 if (level)
-                    pin_error(pin);
+                    pin_fault(pin, level);
             }
+            group_end = TRUE;
             break;
         }
 
@@ -482,20 +1843,21 @@ int main(void)
         case 14: {
             int i;
             memcpy(&trsp, rspbuf, sizeof(trsp));
+            memcpy(board.opt, trsp.u.opt, sizeof(board.opt));
             switch (gw_info.hw_model) {
             case 1:
             case 4:
                 if ((trsp.u.opt[0] != 0xa5)
                     || (trsp.u.opt[1] != 0x5a))
-                    _error("OPT");
+                    fault("OPT", -1, trsp.u.opt[0] | (trsp.u.opt[1] << 8));
                 for (i = 2; i < 16; i += 2)
                     if (trsp.u.opt[i] != 0xff)
-                        _error("OPT");
+                        fault("OPT", -1, trsp.u.opt[i]);
                 break;
             case 7:
                 if ((trsp.u.opt[0] != 0xff)
                     || (trsp.u.opt[1] != 0xaa))
-                    _error("OPT");
+                    fault("OPT", -1, trsp.u.opt[0] | (trsp.u.opt[1] << 8));
                 break;
             }
             printk("Option Bytes:\n");
@@ -503,6 +1865,7 @@ int main(void)
                 printk("%02x ", trsp.u.opt[i]);
                 if ((i&15)==15) printk("\n");
             }
+            group_end = TRUE;
             break;
         }
 
@@ -516,7 +1879,8 @@ int main(void)
         case 16:
             memcpy(&trsp, rspbuf, sizeof(trsp));
             if (trsp.u.x[0] != TESTHEADER_success)
-                _error("HDR");
+                fault("HDR", -1, trsp.u.x[0]);
+            group_end = TRUE;
             break;
 
             /* Test WDAT oscillation */
@@ -532,26 +1896,40 @@ int main(void)
             tcmd.cmd = CMD_wdat_osc_off;
             command_response(&tcmd, sizeof(tcmd),
                              NULL, sizeof(trsp));
+            group_end = TRUE;
             break;
         }
 
             /* USB-C CCn voltage check */
-        case 19:
+        case 19: {
+            uint32_t errs;
             if ((gw_info.hw_model == 4) && (gw_info.hw_submodel == 2)) {
                 /* Greaseweazle V4.1 has USB-C with CCx pulldowns. */
                 if (!test_usb_cc())
-                    _error("CCN");
+                    fault("CCN", -1, max_t(unsigned int, adc_read(ADC_CC1),
+                                           adc_read(ADC_CC2)));
             }
+            /* USB link quality over the whole run. */
+            if (!test_usb_link(&errs)) {
+                usb_trace_dump();
+                fault("LNK", -1, errs);
+            }
+            group_end = TRUE;
             break;
+        }
 
             /* Finish and flash the LED */
         case 20:
             set_pinmask(-1LL);
             cmd_set_pin(-1);
             led_7seg_write_string("---");
+            timer_stats_dump();
+            run_commit();
             success = TRUE;
             break;
         case 21:
+            if (nr_faults || faults_dropped)
+                faults_report();
             if (beeps < 2) {
                 tone(1800, 100);
                 beeps++;
@@ -71,10 +71,18 @@ void set_pinmask(pinmask_t mask)
 pinmask_t read_pinmask(void)
 {
     const struct pin_mapping *ipin;
+    uint16_t idr[_G] = { 0 };
     pinmask_t mask = 0;
 
+    /* Snapshot each bank's input register back to back, so that the
+     * returned mask is a coherent sample of all pins. */
+    idr[_A] = gpioa->idr;
+    idr[_B] = gpiob->idr;
+    idr[_C] = gpioc->idr;
+    idr[_F] = gpiof->idr;
+
     for (ipin = in_pins; ipin->pin_id != 0; ipin++) {
-        if (gpio_read_pin(gpio_from_id(ipin->gpio_bank), ipin->gpio_pin))
+        if (idr[ipin->gpio_bank] & (1u << ipin->gpio_pin))
             mask |= (uint64_t)1u << ipin->pin_id;
     }
 
@@ -136,8 +136,7 @@ static void clock_init(void)
     while ((rcc->cfgr & RCC_CFGR_SWS_MASK) != RCC_CFGR_SWS_PLL)
         cpu_relax();
 
-    /* Internal oscillator no longer needed. */
-    rcc->cr &= ~RCC_CR_HSION;
+    /* Internal oscillator is left running: flash program/erase needs it. */
 
     /* Enable SysTick counter at 72/8=9MHz. */
     stk->load = STK_MASK;
@@ -0,0 +1,260 @@
+/*
+ * store.c
+ *
+ * Log-structured record store in the flash pages reserved above the
+ * firmware image. Records are appended to the head page; when it fills,
+ * the oldest page is erased and becomes the new head. Every page is
+ * therefore erased in turn.
+ *
+ * A record is a header half-word (type, length), the payload padded to a
+ * half-word, and a CRC16 over both. The CRC is programmed last and commits
+ * the record: a record torn by power loss fails its CRC and is skipped.
+ *
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+/* Pages are 2kB: the largest hardware erase unit of the STM32F1 and AT32F4
+ * parts we run on. Smaller parts erase in 1kB units, so each page is erased
+ * unit by unit, skipping any unit already blanked by erasing its neighbour
+ * as part of a larger hardware sector. */
+#define PAGE_SIZE 2048
+#define ERASE_UNIT 1024
+#define NR_PAGES ((_estore - _sstore) / PAGE_SIZE)
+
+/* Page header. The magic is programmed last, after the sequence number. */
+#define PAGE_MAGIC 0x5354 /* "ST" */
+struct page_hdr {
+    uint16_t seq_lo, seq_hi;
+    uint16_t magic, _rsvd;
+};
+
+#define REC_HDR(type, len) (((type) << 8) | (len))
+#define REC_TYPE(hdr) ((hdr) >> 8)
+#define REC_LEN(hdr) ((hdr) & 0xff)
+#define REC_SIZE(len) (2 + (((len) + 1) & ~1) + 2)
+
+static unsigned int head_page;  /* Page being appended to */
+static uint32_t head_seq;
+static unsigned int head_off;   /* Offset of free space in head page */
+
+static uint16_t *page_base(unsigned int page)
+{
+    return (uint16_t *)(_sstore + page * PAGE_SIZE);
+}
+
+static const struct page_hdr *page_hdr(unsigned int page)
+{
+    return (const struct page_hdr *)page_base(page);
+}
+
+static bool_t page_valid(unsigned int page)
+{
+    return page_hdr(page)->magic == PAGE_MAGIC;
+}
+
+static uint32_t page_seq(unsigned int page)
+{
+    const struct page_hdr *h = page_hdr(page);
+    return h->seq_lo | ((uint32_t)h->seq_hi << 16);
+}
+
+static void flash_unlock(void)
+{
+    flash->keyr = 0x45670123;
+    flash->keyr = 0xcdef89ab;
+}
+
+static void flash_lock(void)
+{
+    flash->cr = FLASH_CR_LOCK;
+}
+
+static void flash_wait(void)
+{
+    while (flash->sr & FLASH_SR_BSY)
+        continue;
+    flash->sr = FLASH_SR_EOP | FLASH_SR_PGERR | FLASH_SR_WRPRTERR;
+}
+
+static bool_t flash_blank(const uint32_t *p, unsigned int nr)
+{
+    while (nr--)
+        if (*p++ != ~0u)
+            return FALSE;
+    return TRUE;
+}
+
+static void flash_erase_page(unsigned int page)
+{
+    char *p = (char *)page_base(page);
+    unsigned int off;
+
+    for (off = 0; off < PAGE_SIZE; off += ERASE_UNIT) {
+        if (flash_blank((uint32_t *)(p + off), ERASE_UNIT / 4))
+            continue;
+        flash_unlock();
+        flash->cr = FLASH_CR_PER;
+        flash->ar = (uint32_t)(unsigned long)(p + off);
+        flash->cr = FLASH_CR_PER | FLASH_CR_STRT;
+        flash_wait();
+        flash_lock();
+    }
+}
+
+static void flash_write(uint16_t *dst, const uint16_t *src, unsigned int nr)
+{
+    flash_unlock();
+    flash->cr = FLASH_CR_PG;
+    while (nr--) {
+        *(volatile uint16_t *)dst++ = *src++;
+        flash_wait();
+    }
+    flash_lock();
+}
+
+/* Erase the page after the head and make it the new head. */
+static void new_head(void)
+{
+    struct page_hdr h;
+
+    head_page = (head_page + 1) % NR_PAGES;
+    head_seq++;
+    flash_erase_page(head_page);
+
+    h.seq_lo = head_seq;
+    h.seq_hi = head_seq >> 16;
+    flash_write(&page_base(head_page)[0], &h.seq_lo, 2);
+    h.magic = PAGE_MAGIC;
+    flash_write(&page_base(head_page)[2], &h.magic, 1);
+    head_off = sizeof(h);
+}
+
+static bool_t rec_valid(const uint16_t *p)
+{
+    unsigned int len = REC_LEN(*p);
+    const uint16_t *crc = p + REC_SIZE(len)/2 - 1;
+    return crc16_ccitt(p, 2 + len, 0xffff) == *crc;
+}
+
+bool_t store_append(uint8_t type, const void *p, unsigned int len)
+{
+    uint16_t buf[REC_SIZE(255)/2], *dst;
+    unsigned int size = REC_SIZE(len);
+
+    if ((len > 255) || (type == 0xff))
+        return FALSE;
+
+    if (head_off + size > PAGE_SIZE)
+        new_head();
+
+    if (len & 1)
+        buf[size/2 - 2] = 0xffff; /* pad byte */
+    buf[0] = REC_HDR(type, len);
+    memcpy(&buf[1], p, len);
+    buf[size/2 - 1] = crc16_ccitt(buf, 2 + len, 0xffff);
+
+    /* Header and payload, then the committing CRC. */
+    dst = &page_base(head_page)[head_off/2];
+    flash_write(dst, buf, size/2 - 1);
+    flash_write(dst + size/2 - 1, &buf[size/2 - 1], 1);
+    head_off += size;
+
+    return rec_valid(dst);
+}
+
+/* The head's sequence number changes whenever a new page is started. */
+uint32_t store_seq(void)
+{
+    return head_seq;
+}
+
+/* Iterate over committed records, oldest first. The iterator is
+ * zero-initialised to start. Returns a pointer into flash. */
+const void *store_next(struct store_iter *it, uint8_t *type,
+                       unsigned int *len)
+{
+    const uint16_t *p;
+    uint16_t hdr;
+
+    for (;;) {
+        if (it->off == 0) {
+            /* Start of a page: the oldest follows the head. */
+            if (it->page++ >= NR_PAGES)
+                return NULL;
+            if (!page_valid((head_page + it->page) % NR_PAGES))
+                continue;
+            it->off = sizeof(struct page_hdr);
+        }
+        p = &page_base((head_page + it->page) % NR_PAGES)[it->off/2];
+        hdr = *p;
+        if ((hdr == 0xffff)
+            || (it->off + REC_SIZE(REC_LEN(hdr)) > PAGE_SIZE)) {
+            it->off = 0; /* end of page */
+            continue;
+        }
+        it->off += REC_SIZE(REC_LEN(hdr));
+        if (!rec_valid(p))
+            continue; /* torn */
+        *type = REC_TYPE(hdr);
+        *len = REC_LEN(hdr);
+        return p + 1;
+    }
+}
+
+void store_erase(void)
+{
+    unsigned int page;
+
+    for (page = 0; page < NR_PAGES; page++)
+        flash_erase_page(page);
+    head_page = NR_PAGES - 1;
+    head_seq = 0;
+    new_head();
+}
+
+void store_init(void)
+{
+    unsigned int page, off, hdr;
+    bool_t found = FALSE;
+
+    /* The linker script's STORE_LEN must be a whole number of pages. */
+    ASSERT(!((unsigned long)_sstore % PAGE_SIZE));
+    ASSERT(!((_estore - _sstore) % PAGE_SIZE));
+    ASSERT(NR_PAGES >= 2);
+
+    /* The head is the valid page with the highest sequence number. */
+    for (page = 0; page < NR_PAGES; page++) {
+        if (!page_valid(page))
+            continue;
+        if (!found || (int32_t)(page_seq(page) - head_seq) > 0) {
+            head_page = page;
+            head_seq = page_seq(page);
+            found = TRUE;
+        }
+    }
+
+    if (!found) {
+        store_erase();
+        return;
+    }
+
+    /* Find free space in the head page. */
+    off = sizeof(struct page_hdr);
+    while ((off < PAGE_SIZE)
+           && ((hdr = page_base(head_page)[off/2]) != 0xffff))
+        off += REC_SIZE(REC_LEN(hdr));
+    head_off = off;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -1,7 +1,7 @@
 /*  
  * time.c
  * 
- * System-time abstraction over STM32 STK timer.
+ * System-time abstraction over chained STM32 TIM2/TIM3 timers.
  * 
  * Written & released by Keir Fraser <keir.xen@gmail.com>
  * 
@@ -9,8 +9,16 @@
  * See the file COPYING for more details, or visit <http://unlicense.org>.
  */
 
-static volatile time_t time_stamp;
-static struct timer time_stamp_timer;
+/* TIM2 counts ticks and clocks TIM3 on each overflow, forming a free-running
+ * 32-bit counter. TIM3 overflows are counted to extend it to 64 bits. */
+#define tim_lo tim2
+#define tim_hi tim3
+
+/* TIM3: IRQ 29. */
+void IRQ_29(void) __attribute__((alias("IRQ_time_wrap")));
+#define TIME_WRAP_IRQ 29
+
+static volatile uint32_t time_wraps;
 
 void delay_from(time_t t, unsigned int ticks)
 {
@@ -19,32 +27,67 @@ void delay_from(time_t t, unsigned int ticks)
         delay_ticks(diff);
 }
 
-static void time_stamp_update(void *unused)
+time_t time_now(void)
 {
-    time_t now = time_now();
-    time_stamp = ~now;
-    timer_set(&time_stamp_timer, now + time_ms(500));
+    uint32_t hi, lo;
+
+    /* Retry if the high half ticks mid-read. TIM3 increments a couple of
+     * cycles after TIM2 wraps, so a low half of zero is not trusted. */
+    do {
+        hi = tim_hi->cnt;
+        lo = tim_lo->cnt;
+    } while ((hi != tim_hi->cnt) || (lo == 0));
+
+    return (hi << 16) | lo;
 }
 
-time_t time_now(void)
+uint64_t time64_now(void)
+{
+    uint32_t oldpri, wraps;
+    time_t now;
+
+    oldpri = IRQ_save(TIMER_IRQ_PRI);
+    wraps = time_wraps;
+    now = time_now();
+    /* A wrap not yet counted by IRQ_time_wrap(). */
+    if ((tim_hi->sr & TIM_SR_UIF) && (now < 0x80000000u))
+        wraps++;
+    IRQ_restore(oldpri);
+
+    return ((uint64_t)wraps << 32) | now;
+}
+
+static void IRQ_time_wrap(void)
 {
-    time_t s, t;
-    s = time_stamp;
-    t = stk_now() | (s & (0xff << 24));
-    if (t > s)
-        t -= 1u << 24;
-    return ~t;
+    tim_hi->sr = ~TIM_SR_UIF;
+    time_wraps++;
 }
 
 void time_init(void)
 {
+    /* TIM2: Tick counter, TRGO on overflow. */
+    tim_lo->psc = SYSCLK_MHZ/TIME_MHZ-1;
+    tim_lo->arr = 0xffff;
+    tim_lo->cr2 = TIM_CR2_MMS(TIM_MMS_UPDATE);
+    tim_lo->egr = TIM_EGR_UG; /* update CNT, PSC, ARR */
+
+    /* TIM3: Clocked by TIM2 TRGO (ITR1), IRQ on overflow. */
+    tim_hi->psc = 0;
+    tim_hi->arr = 0xffff;
+    tim_hi->smcr = TIM_SMCR_TS(TIM_TS_ITR1) | TIM_SMCR_SMS(TIM_SMS_EXT_CLK1);
+    tim_hi->dier = TIM_DIER_UIE;
+    tim_hi->egr = TIM_EGR_UG;
+    tim_hi->cnt = 0;
+    tim_hi->sr = 0;
+    IRQx_set_prio(TIME_WRAP_IRQ, TIMER_IRQ_PRI);
+    IRQx_enable(TIME_WRAP_IRQ);
+    tim_hi->cr1 = TIM_CR1_URS | TIM_CR1_CEN;
+    tim_lo->cr1 = TIM_CR1_CEN;
+
     timers_init();
-    time_stamp = stk_now();
-    timer_init(&time_stamp_timer, time_stamp_update, NULL);
-    timer_set(&time_stamp_timer, time_now() + time_ms(500));
+    timers_calibrate();
 }
 
-
 /*
  * Local variables:
  * mode: C
@@ -17,13 +17,51 @@ void IRQ_30(void) __attribute__((alias("IRQ_timer")));
 /* IRQ only on counter overflow, one-time enable. */
 #define TIM_CR1 (TIM_CR1_URS | TIM_CR1_OPM)
 
-/* Empirically-determined offset applied to timer deadlines to counteract the
- * latency incurred by reprogram_timer() and IRQ_timer(). */
-#define SLACK_TICKS 12
+/* Offset applied to timer deadlines to counteract the latency incurred by
+ * reprogram_timer() and IRQ_timer(). Calibrated at boot. */
+static int32_t slack_ticks = 12;
 
-#define TIMER_INACTIVE ((struct timer *)1ul)
+/* Timers whose callback lateness is reported by timer_stats_dump(). */
+static struct timer *stats_timers[8];
 
-static struct timer *head;
+/* Timing wheel. Level-0 slots are 2^10 ticks (~114us) wide and the level
+ * spans the fine-grained range of reprogram_timer(). Each further level is
+ * 64x coarser. Deadlines beyond the top level (~30s) wait on an overflow
+ * list which is rescanned each time the top level wraps. Timers within a
+ * slot are unordered: insert and cancel are O(1). */
+#define LVL_BITS     6
+#define LVL_SIZE     (1u<<LVL_BITS)
+#define LVL_SHIFT(l) (10 + (l)*LVL_BITS)
+#define NR_LEVELS    3
+#define OVERFLOW_SLOT (NR_LEVELS*LVL_SIZE)
+
+static struct timer *wheel[NR_LEVELS*LVL_SIZE + 1];
+static uint32_t pending[NR_LEVELS*LVL_SIZE/32]; /* non-empty wheel slots */
+
+/* A level-0 slot boundary, at most slack_ticks ahead of time_now(). All
+ * timers due before the end of its slot are in that level-0 slot. */
+static time_t wheel_clk;
+
+/* Time-until-deadline of an empty slot. */
+#define DELTA_EMPTY 0x7fffffff
+
+/* The deadline last programmed into the hardware. */
+static time_t hw_deadline;
+static bool_t hw_armed;
+
+#if defined(BENCH)
+/* Worst-case cycles spent with the timer IRQ masked, by operation. */
+enum { BENCH_SET, BENCH_CANCEL, BENCH_IRQ, BENCH_NR };
+static uint32_t bench_max[BENCH_NR];
+#define BENCH_CRIT(idx, stmt) do {                      \
+    uint32_t __t = dwt->cyccnt;                         \
+    stmt;                                               \
+    __t = dwt->cyccnt - __t;                            \
+    bench_max[idx] = max(bench_max[idx], __t);          \
+} while (0)
+#else
+#define BENCH_CRIT(idx, stmt) stmt
+#endif
 
 static void reprogram_timer(int32_t delta)
 {
@@ -31,7 +69,7 @@ static void reprogram_timer(int32_t delta)
     if (delta < 0x10000) {
         /* Fine-grained deadline (sub-microsecond accurate) */
         tim->psc = SYSCLK_MHZ/TIME_MHZ-1;
-        tim->arr = (delta <= SLACK_TICKS) ? 1 : delta-SLACK_TICKS;
+        tim->arr = (delta <= slack_ticks) ? 1 : delta-slack_ticks;
     } else {
         /* Coarse-grained deadline, fires in time to set a shorter,
          * fine-grained deadline. */
@@ -44,64 +82,194 @@ static void reprogram_timer(int32_t delta)
     tim->cr1 = TIM_CR1 | TIM_CR1_CEN;
 }
 
+static void program_timer(time_t now, int32_t delta)
+{
+    hw_deadline = time_add(now, delta);
+    hw_armed = TRUE;
+    reprogram_timer(delta);
+}
+
 void timer_init(struct timer *timer, void (*cb_fn)(void *), void *cb_dat)
 {
     timer->cb_fn = cb_fn;
     timer->cb_dat = cb_dat;
-    timer->next = TIMER_INACTIVE;
+    timer->pprev = NULL;
+    timer->lat_min = timer->lat_max = timer->lat_sum = 0;
+    timer->lat_nr = 0;
 }
 
 static bool_t timer_is_active(struct timer *timer)
 {
-    return timer->next != TIMER_INACTIVE;
+    return timer->pprev != NULL;
 }
 
-static void _timer_cancel(struct timer *timer)
+static void enqueue(struct timer *timer)
 {
-    struct timer *t, **pprev;
+    int32_t delta = time_diff(wheel_clk, timer->deadline);
+    time_t t = timer->deadline;
+    unsigned int l, slot;
 
-    if (!timer_is_active(timer))
-        return;
+    if (delta < 0)
+        t = wheel_clk; /* overdue: current slot */
 
-    for (pprev = &head; (t = *pprev) != timer; pprev = &t->next)
-        continue;
+    for (l = 0; l < NR_LEVELS; l++)
+        if (delta < (1 << LVL_SHIFT(l+1)))
+            break;
 
-    *pprev = t->next;
-    t->next = TIMER_INACTIVE;
+    if (l == NR_LEVELS) {
+        slot = OVERFLOW_SLOT;
+    } else {
+        slot = l*LVL_SIZE + ((t >> LVL_SHIFT(l)) & (LVL_SIZE-1));
+        pending[slot/32] |= 1u << (slot&31);
+    }
+
+    timer->slot = slot;
+    if ((timer->next = wheel[slot]) != NULL)
+        timer->next->pprev = &timer->next;
+    timer->pprev = &wheel[slot];
+    wheel[slot] = timer;
 }
 
-void timer_set(struct timer *timer, time_t deadline)
+static void dequeue(struct timer *timer)
 {
-    struct timer *t, **pprev;
-    time_t now;
-    int32_t delta;
-    uint32_t oldpri;
+    unsigned int slot = timer->slot;
 
-    oldpri = IRQ_save(TIMER_IRQ_PRI);
+    if ((*timer->pprev = timer->next) != NULL)
+        timer->next->pprev = timer->pprev;
+    timer->pprev = NULL;
+
+    if ((wheel[slot] == NULL) && (slot != OVERFLOW_SLOT))
+        pending[slot/32] &= ~(1u << (slot&31));
+}
 
-    _timer_cancel(timer);
+/* Re-insert every timer in a slot relative to the current wheel time. */
+static void requeue_slot(unsigned int slot)
+{
+    struct timer *t, *next;
 
-    timer->deadline = deadline;
+    t = wheel[slot];
+    wheel[slot] = NULL;
+    if (slot != OVERFLOW_SLOT)
+        pending[slot/32] &= ~(1u << (slot&31));
 
-    now = time_now();
-    delta = time_diff(now, deadline);
-    for (pprev = &head; (t = *pprev) != NULL; pprev = &t->next)
-        if (delta <= time_diff(now, t->deadline))
-            break;
-    timer->next = *pprev;
-    *pprev = timer;
+    for (; t != NULL; t = next) {
+        next = t->next;
+        enqueue(t);
+    }
+}
+
+/* Cascade coarser slots which start at the new wheel time. */
+static void cascade(void)
+{
+    unsigned int l;
+
+    for (l = 1; l < NR_LEVELS; l++) {
+        if (wheel_clk & ((1u << LVL_SHIFT(l)) - 1))
+            return;
+        requeue_slot(l*LVL_SIZE
+                     + ((wheel_clk >> LVL_SHIFT(l)) & (LVL_SIZE-1)));
+    }
+
+    if (!(wheel_clk & ((1u << LVL_SHIFT(NR_LEVELS)) - 1)))
+        requeue_slot(OVERFLOW_SLOT);
+}
+
+/* First non-empty slot at index @from or above within level @l, or -1. */
+static int find_pending(unsigned int l, unsigned int from)
+{
+    unsigned int i;
+    uint32_t w;
+
+    for (i = from; i < LVL_SIZE; i = (i | 31) + 1) {
+        w = pending[(l*LVL_SIZE + i) / 32] >> (i & 31);
+        if (w)
+            return i + __builtin_ctz(w);
+    }
+
+    return -1;
+}
+
+/* Find the next wheel time, beyond the current level-0 slot, at which a
+ * slot needs attention: a pending level-0 slot, or a cascade into level 0.
+ * Returns the responsible level, or -1 if the wheel is empty. */
+static int next_event(time_t *p)
+{
+    unsigned int l;
+    int i;
+
+    for (l = 0; l < NR_LEVELS; l++) {
+        i = find_pending(l, ((wheel_clk >> LVL_SHIFT(l)) & (LVL_SIZE-1)) + 1);
+        if (i < 0) {
+            if (find_pending(l, 0) < 0)
+                continue;
+            i = LVL_SIZE; /* pending slots have wrapped */
+        }
+        *p = (wheel_clk & ~((1u << LVL_SHIFT(l+1)) - 1))
+            + ((time_t)i << LVL_SHIFT(l));
+        return l;
+    }
+
+    if (wheel[OVERFLOW_SLOT] == NULL)
+        return -1;
+    *p = (wheel_clk & ~((1u << LVL_SHIFT(NR_LEVELS)) - 1))
+        + (1u << LVL_SHIFT(NR_LEVELS));
+    return NR_LEVELS;
+}
+
+/* Returns an expired timer from a level-0 slot, or else NULL with *pdelta
+ * set to the time until the slot's earliest deadline. */
+static struct timer *slot_scan(unsigned int slot, time_t now, int32_t *pdelta)
+{
+    struct timer *t;
+    int32_t delta, earliest = DELTA_EMPTY;
+
+    for (t = wheel[slot]; t != NULL; t = t->next) {
+        if ((delta = time_diff(now, t->deadline)) <= slack_ticks)
+            return t;
+        earliest = min(earliest, delta);
+    }
+
+    *pdelta = earliest;
+    return NULL;
+}
+
+static void _timer_set(struct timer *timer, time_t deadline)
+{
+    time_t now = time_now();
 
-    if (head == timer)
-        reprogram_timer(delta);
+    if (timer_is_active(timer))
+        dequeue(timer);
 
+    /* An idle wheel restarts at the current time. */
+    if (!hw_armed)
+        wheel_clk = now & ~((1u << LVL_SHIFT(0)) - 1);
+
+    timer->deadline = deadline;
+    enqueue(timer);
+
+    if (!hw_armed || (time_diff(hw_deadline, deadline) < 0))
+        program_timer(now, time_diff(now, deadline));
+}
+
+void timer_set(struct timer *timer, time_t deadline)
+{
+    uint32_t oldpri;
+    oldpri = IRQ_save(TIMER_IRQ_PRI);
+    BENCH_CRIT(BENCH_SET, _timer_set(timer, deadline));
     IRQ_restore(oldpri);
 }
 
+static void _timer_cancel(struct timer *timer)
+{
+    if (timer_is_active(timer))
+        dequeue(timer);
+}
+
 void timer_cancel(struct timer *timer)
 {
     uint32_t oldpri;
     oldpri = IRQ_save(TIMER_IRQ_PRI);
-    _timer_cancel(timer);
+    BENCH_CRIT(BENCH_CANCEL, _timer_cancel(timer));
     IRQ_restore(oldpri);
 }
 
@@ -113,24 +281,194 @@ void timers_init(void)
     IRQx_enable(TIMER_IRQ);
 }
 
-static void IRQ_timer(void)
+/* Track how late a callback runs relative to its deadline. The mean is over
+ * a window of up to 1024 callbacks, halved as it fills. */
+static void account_lateness(struct timer *t)
+{
+    int32_t lat = time_diff(t->deadline, time_now());
+    unsigned int i;
+
+    lat = max_t(int32_t, min_t(int32_t, lat, 1<<20), -(1<<20));
+
+    if (t->lat_nr == 0) {
+        t->lat_min = t->lat_max = lat;
+        for (i = 0; i < ARRAY_SIZE(stats_timers); i++) {
+            if (stats_timers[i] == t)
+                break;
+            if (stats_timers[i] == NULL) {
+                stats_timers[i] = t;
+                break;
+            }
+        }
+    }
+
+    t->lat_min = min(t->lat_min, lat);
+    t->lat_max = max(t->lat_max, lat);
+    t->lat_sum += lat;
+    if (++t->lat_nr == 1024) {
+        t->lat_sum /= 2;
+        t->lat_nr /= 2;
+    }
+}
+
+static void run_timers(void)
 {
     struct timer *t;
+    time_t now, next;
     int32_t delta;
+    int l;
+
+    for (;;) {
+        now = time_now();
+
+        /* Run expired timers in the current level-0 slot. */
+        t = slot_scan((wheel_clk >> LVL_SHIFT(0)) & (LVL_SIZE-1),
+                      now, &delta);
+        if (t != NULL) {
+            dequeue(t);
+            account_lateness(t);
+            (*t->cb_fn)(t->cb_dat);
+            continue;
+        }
+        if (delta != DELTA_EMPTY) {
+            program_timer(now, delta);
+            return;
+        }
 
+        /* Current slot is empty: advance the wheel. */
+        if ((l = next_event(&next)) < 0) {
+            hw_armed = FALSE;
+            return;
+        }
+        delta = time_diff(now, next);
+        if (delta <= slack_ticks) {
+            wheel_clk = next;
+            cascade();
+            continue;
+        }
+        if ((l == 0) && (next & ((1u << LVL_SHIFT(1)) - 1))) {
+            /* No cascade is due at the next pending slot: wake directly
+             * at the earliest deadline within it. */
+            slot_scan((next >> LVL_SHIFT(0)) & (LVL_SIZE-1), now, &delta);
+        }
+        program_timer(now, delta);
+        return;
+    }
+}
+
+static void IRQ_timer(void)
+{
     tim->sr = 0;
+    BENCH_CRIT(BENCH_IRQ, run_timers());
+}
 
-    while ((t = head) != NULL) {
-        if ((delta = time_diff(time_now(), t->deadline)) > SLACK_TICKS) {
-            reprogram_timer(delta);
+static volatile time_t cal_time;
+static volatile bool_t cal_done;
+
+static void calibrate_cb(void *unused)
+{
+    cal_time = time_now();
+    cal_done = TRUE;
+}
+
+/* Measure latency from hardware deadline to callback with no slack applied.
+ * The best case over several runs becomes the slack: callbacks are then
+ * never early, and typically on time to within a tick. */
+void timers_calibrate(void)
+{
+    static struct timer t;
+    time_t deadline;
+    int32_t lat, best = 0x7fffffff;
+    unsigned int i;
+
+    slack_ticks = 0;
+    timer_init(&t, calibrate_cb, NULL);
+
+    for (i = 0; i < 16; i++) {
+        cal_done = FALSE;
+        deadline = time_now() + time_us(100);
+        timer_set(&t, deadline);
+        while (!cal_done)
+            cpu_relax();
+        lat = time_diff(deadline, cal_time);
+        best = min(best, lat);
+    }
+
+    slack_ticks = range_t(int32_t, best, 0, time_us(5));
+    memset(stats_timers, 0, sizeof(stats_timers));
+}
+
+void timer_stats_dump(void)
+{
+    struct timer *t;
+    int32_t lat_min, lat_max, lat_mean;
+    uint32_t oldpri;
+    unsigned int i;
+
+    console_printf("Timers: slack %d ticks, lateness min/mean/max (ns):\n",
+                   slack_ticks);
+    for (i = 0; i < ARRAY_SIZE(stats_timers); i++) {
+        if ((t = stats_timers[i]) == NULL)
             break;
+        oldpri = IRQ_save(TIMER_IRQ_PRI);
+        lat_min = t->lat_min;
+        lat_max = t->lat_max;
+        lat_mean = t->lat_nr ? t->lat_sum / (int32_t)t->lat_nr : 0;
+        IRQ_restore(oldpri);
+        console_printf(" %p: %d/%d/%d\n", t->cb_fn,
+                       lat_min * 1000 / TIME_MHZ, lat_mean * 1000 / TIME_MHZ,
+                       lat_max * 1000 / TIME_MHZ);
+    }
+}
+
+#if defined(BENCH)
+
+static void bench_cb(void *unused)
+{
+}
+
+/* Load the wheel with timers spread over every level, re-arming and
+ * cancelling them while the short ones fire. Reports the worst case time
+ * with the timer IRQ masked, which bounds added latency for the timer IRQ
+ * and everything below it. */
+void timer_bench(void)
+{
+    static struct timer timers[64];
+    unsigned int i, j;
+    time_t now, d;
+
+    dbg->demcr |= DBG_DEMCR_TRCENA;
+    dwt->ctrl |= DWT_CTRL_CYCCNTENA;
+    memset(bench_max, 0, sizeof(bench_max));
+
+    for (i = 0; i < ARRAY_SIZE(timers); i++)
+        timer_init(&timers[i], bench_cb, NULL);
+
+    for (j = 0; j < 32; j++) {
+        now = time_now();
+        for (i = 0; i < ARRAY_SIZE(timers); i++) {
+            /* ~100us to ~2s, and some on the overflow list. */
+            d = (i & 15) == 15 ? time_ms(40000)
+                : time_us(100) + ((rand() & 0xffffff) >> (i & 15));
+            timer_set(&timers[i], now + d);
         }
-        head = t->next;
-        t->next = TIMER_INACTIVE;
-        (*t->cb_fn)(t->cb_dat);
+        delay_ms(1);
+        for (i = 0; i < ARRAY_SIZE(timers); i += 2)
+            timer_cancel(&timers[i]);
     }
+
+    for (i = 0; i < ARRAY_SIZE(timers); i++)
+        timer_cancel(&timers[i]);
+    memset(stats_timers, 0, sizeof(stats_timers));
+
+    console_printf("Timers, max cycles with IRQ masked: "
+                   "set %u, cancel %u, irq %u\n",
+                   bench_max[BENCH_SET], bench_max[BENCH_CANCEL],
+                   bench_max[BENCH_IRQ]);
 }
 
+#endif
+
 /*
  * Local variables:
  * mode: C
@@ -45,11 +45,14 @@ void USB_OTG_BSP_Suspend(USB_OTG_CORE_HANDLE *pdev);
 #endif /* USE_HOST_MODE */
 
 struct USB_OTG_BSP_Timer {
-    uint32_t prev_stk, ticks;
+    time_t deadline;
 };
 void USB_OTG_BSP_InitTimer(struct USB_OTG_BSP_Timer *t, uint32_t timeout_ms);
 bool_t USB_OTG_BSP_TimerFired(struct USB_OTG_BSP_Timer *t);
 
+/* Called in USB IRQ context after queueing URB completion events. */
+void USB_OTG_BSP_NotifyURB(USB_OTG_CORE_HANDLE *pdev);
+
 
 #endif /* __USB_BSP__H__ */
 
@@ -102,6 +102,7 @@ typedef struct USB_OTG_hc {
     uint8_t       *xfer_buff;
     uint32_t      xfer_len;
     uint32_t      xfer_count;
+    uint16_t      xfer_pkts;
     uint8_t       toggle_in;
     uint8_t       toggle_out;
     uint32_t       dma_addr;
@@ -216,15 +217,35 @@ typedef struct _DCD {
 } DCD_DEV , *DCD_PDEV;
 
 
+struct USB_OTG_handle;
+
+/* URB completion hook: called in IRQ context when a channel halts, after its
+ * URB_State has been updated. The hook may resubmit on the same channel. */
+typedef void (*USB_OTG_URB_CB)(struct USB_OTG_handle *pdev, uint8_t hc_num);
+
+/* URB completion events: channel numbers queued by the USB IRQ (sole
+ * producer) for the class driver's event handler (sole consumer). */
+#define URB_EVT_QUEUE_LEN 16U /* power of two */
+#define URB_EVT_ANY      0xFFU /* queue overflowed: check every channel */
+
+/* Link quality counters, accumulated per channel since HCD_Init(). */
+typedef struct usb_link_stats USB_OTG_HC_STATS;
+
 typedef struct _HCD {
     __IO uint32_t            ConnSts;
     __IO uint32_t            PortEnabled;
+    __IO uint32_t            NPTxPending; /* channels awaiting Tx FIFO space */
     __IO uint32_t            ErrCnt[USB_OTG_MAX_TX_FIFOS];
     __IO uint32_t            XferCnt[USB_OTG_MAX_TX_FIFOS];
     __IO HC_STATUS           HC_Status[USB_OTG_MAX_TX_FIFOS];
     __IO URB_STATE           URB_State[USB_OTG_MAX_TX_FIFOS];
     USB_OTG_HC               hc [USB_OTG_MAX_TX_FIFOS];
     uint16_t                 channel [USB_OTG_MAX_TX_FIFOS];
+    USB_OTG_URB_CB           URB_Cb [USB_OTG_MAX_TX_FIFOS];
+    uint8_t                  URB_Evt [URB_EVT_QUEUE_LEN];
+    __IO uint8_t             URB_EvtProd, URB_EvtCons; /* free-running */
+    __IO uint8_t             URB_EvtOverflow;
+    USB_OTG_HC_STATS         Stats [USB_OTG_MAX_TX_FIFOS];
 } HCD_DEV , *USB_OTG_USBH_PDEV;
 
 
@@ -279,9 +300,11 @@ USB_OTG_STS  USB_OTG_EnableHostInt   (USB_OTG_CORE_HANDLE *pdev);
 USB_OTG_STS  USB_OTG_HC_Init         (USB_OTG_CORE_HANDLE *pdev, uint8_t hc_num);
 USB_OTG_STS  USB_OTG_HC_Halt         (USB_OTG_CORE_HANDLE *pdev, uint8_t hc_num);
 USB_OTG_STS  USB_OTG_HC_StartXfer    (USB_OTG_CORE_HANDLE *pdev, uint8_t hc_num);
+uint32_t     USB_OTG_HC_WriteNPTxFifo(USB_OTG_CORE_HANDLE *pdev, uint8_t hc_num);
 USB_OTG_STS  USB_OTG_HC_DoPing       (USB_OTG_CORE_HANDLE *pdev , uint8_t hc_num);
 uint32_t     USB_OTG_ReadHostAllChannels_intr    (USB_OTG_CORE_HANDLE *pdev);
 uint32_t     USB_OTG_ResetPort       (USB_OTG_CORE_HANDLE *pdev);
+void         USB_OTG_DrivePortReset  (USB_OTG_CORE_HANDLE *pdev, uint8_t state);
 uint32_t     USB_OTG_ReadHPRT0       (USB_OTG_CORE_HANDLE *pdev);
 void         USB_OTG_DriveVbus       (USB_OTG_CORE_HANDLE *pdev, uint8_t state);
 void         USB_OTG_InitFSLSPClkSel (USB_OTG_CORE_HANDLE *pdev ,uint8_t freq);
@@ -0,0 +1,82 @@
+/*
+ * usb_trace.h
+ *
+ * Always-on trace of USB host channel events, kept in a small RAM ring and
+ * dumped to the console when a transfer fails.
+ *
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#ifndef __USB_TRACE_H__
+#define __USB_TRACE_H__
+
+/* Event codes. Must match scripts/usb_trace.py. */
+enum {
+    USB_TRACE_START = 0, /* count = transfer length */
+    USB_TRACE_ACK,
+    USB_TRACE_NAK,       /* count = consecutive NAKs */
+    USB_TRACE_NYET,
+    USB_TRACE_STALL,
+    USB_TRACE_XACTERR,
+    USB_TRACE_DATATGLERR,
+    USB_TRACE_FRMOVRUN,
+    USB_TRACE_XFRC,
+    USB_TRACE_HALT,      /* count = bytes transferred */
+    USB_TRACE_URB,       /* count = URB_State */
+    USB_TRACE_BBLERR
+};
+
+/* Channel number flag: IN channel. */
+#define USB_TRACE_IN 0x80
+
+struct usb_trace_ent {
+    time_t time;
+    uint16_t count;
+    uint8_t ch, ev;
+};
+
+#define USB_TRACE_NR 128 /* power of two */
+
+extern struct usb_trace {
+    uint32_t prod;
+    struct usb_trace_ent ent[USB_TRACE_NR];
+} usb_trace;
+
+/* Record an event. Safe from any context at or below USB IRQ priority.
+ * Runs of NAKs on one channel are folded into a single entry. */
+static inline void usb_trace_ev(uint8_t ch, uint8_t ev, uint32_t count)
+{
+    struct usb_trace_ent *e;
+    uint32_t oldpri, p;
+
+    oldpri = IRQ_save(USB_IRQ_PRI);
+    p = usb_trace.prod;
+    e = &usb_trace.ent[(p-1) & (USB_TRACE_NR-1)];
+    if ((ev == USB_TRACE_NAK) && (e->ev == ev) && (e->ch == ch)
+        && (e->count != 0xffff)) {
+        e->count++;
+    } else {
+        e = &usb_trace.ent[p & (USB_TRACE_NR-1)];
+        e->time = time_now();
+        e->count = min_t(uint32_t, count, 0xffff);
+        e->ch = ch;
+        e->ev = ev;
+        usb_trace.prod = p + 1;
+    }
+    IRQ_restore(oldpri);
+}
+
+#endif /* __USB_TRACE_H__ */
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -301,6 +301,14 @@ typedef struct
 }
 CDC_DataItfTypedef ;
 
+/* One segment of a scatter-gather transmit list */
+typedef struct
+{
+  uint8_t                           *pbuff;
+  uint32_t                           length;
+}
+CDC_TxSegTypeDef;
+
 /* Structure for CDC process */
 typedef struct _CDC_Process
 {
@@ -310,6 +318,10 @@ typedef struct _CDC_Process
   uint8_t                           *pRxData;
   uint32_t                           TxDataLength;
   uint32_t                           RxDataLength;
+  const CDC_TxSegTypeDef            *pTxSeg;       /* current segment */
+  uint32_t                           TxSegCount;   /* remaining segments */
+  uint32_t                           TxUrbLength;  /* in-flight URB */
+  CDC_TxSegTypeDef                   TxSingle;
   CDC_InterfaceDesc_Typedef         CDC_Desc;
   CDC_LineCodingTypeDef             LineCoding;
   CDC_LineCodingTypeDef             *pUserLineCoding;
@@ -331,15 +343,33 @@ USBH_Status  USBH_CDC_GetLineCoding(USBH_HOST *phost,
 USBH_Status  USBH_CDC_Transmit(uint8_t *pbuff,
                                       uint32_t length);
 
+USBH_Status  USBH_CDC_TransmitSG(const CDC_TxSegTypeDef *seg,
+                                 uint32_t nr);
+
 USBH_Status  USBH_CDC_Receive(uint8_t *pbuff,
                                      uint32_t length);
 
+USBH_Status  USBH_CDC_StreamStart(uint8_t *pbuff,
+                                  uint32_t size);
+
+void         USBH_CDC_StreamStop(void);
 
-uint16_t     USBH_CDC_GetLastReceivedDataSize(USBH_HOST *phost);
+uint8_t     *USBH_CDC_StreamPeek(uint32_t *plen);
+
+void         USBH_CDC_StreamConsume(uint32_t len);
+
+uint8_t      USBH_CDC_StreamError(void);
 
 USBH_Status  USBH_CDC_Stop(USBH_HOST *phost);
 
-void USBH_CDC_LineCodingChanged(USBH_HOST *phost);
+void         USBH_CDC_ProcessEvents(USB_OTG_CORE_HANDLE *pdev);
+
+void         USBH_CDC_Abort(void);
+
+void         USBH_CDC_GetLinkStats(USB_OTG_HC_STATS *out,
+                                   USB_OTG_HC_STATS *in);
+
+void USBH_CDC_LineCodingChanged(void);
 
 void USBH_CDC_TransmitCallback(void);
 
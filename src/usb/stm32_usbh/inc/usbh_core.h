@@ -29,6 +29,7 @@
 #define __USBH_CORE_H
 
 #include "usb_hcd.h"
+#include "usb_bsp.h"
 #include "usbh_def.h"
 #include "usbh_conf.h"
 
@@ -60,7 +61,10 @@ typedef enum {
     HOST_USR_INPUT,
     HOST_SUSPENDED,
     HOST_WAKEUP,
-    HOST_ERROR_STATE
+    HOST_ERROR_STATE,
+    HOST_DELAY,
+    HOST_PORT_RESET,
+    HOST_PORT_RESET_DONE
 } HOST_State;
 
 /* Following states are used for EnumerationState */
@@ -169,6 +173,11 @@ typedef struct _Host_TypeDef
 {
     HOST_State            gState;       /*  Host State Machine Value */
     HOST_State            gStateBkp;    /* backup of previous State machine value */
+    HOST_State            gStateNext;   /* state to enter after HOST_DELAY */
+    HOST_State            gStateReset;  /* state to enter after port reset */
+    uint8_t               PortSettling; /* port may be disabled: attach/reset */
+    struct USB_OTG_BSP_Timer Timer;     /* HOST_DELAY deadline */
+    struct USB_OTG_BSP_Timer PortTimer; /* port enable deadline after reset */
     ENUM_State            EnumState;    /* Enumeration state Machine */
     CMD_State             RequestState;
     USBH_Ctrl_TypeDef     Control;
@@ -27,6 +27,7 @@
 
 #include "usb_core.h"
 #include "usb_bsp.h"
+#include "usb_trace.h"
 
 uint8_t *Cfg_Rx_Buffer;
 
@@ -100,6 +101,33 @@ static USB_OTG_STS USB_OTG_CoreReset(USB_OTG_CORE_HANDLE *pdev)
     return status;
 }
 
+/* Burst copies of 32-byte blocks between RAM and a data FIFO, in the style
+ * of memcpy_fast(). Every address within a FIFO's 4kB window accesses the
+ * same FIFO, so LDM/STM without writeback on the FIFO side pops/pushes eight
+ * words per instruction. The RAM pointer must be word aligned, and n must be
+ * a non-zero multiple of 32. */
+void fifo_read_fast(void *dest, __IO uint32_t *fifo, size_t n);
+void fifo_write_fast(__IO uint32_t *fifo, const void *src, size_t n);
+asm (
+".global fifo_read_fast, fifo_write_fast\n"
+"fifo_read_fast:\n"
+"    push  {r4-r10}\n"
+"1:  ldmia r1,{r3-r10}\n"
+"    stmia r0!,{r3-r10}\n"
+"    subs  r2,r2,#32\n"
+"    bne   1b\n"
+"    pop   {r4-r10}\n"
+"    bx    lr\n"
+"fifo_write_fast:\n"
+"    push  {r4-r10}\n"
+"1:  ldmia r1!,{r3-r10}\n"
+"    stmia r0,{r3-r10}\n"
+"    subs  r2,r2,#32\n"
+"    bne   1b\n"
+"    pop   {r4-r10}\n"
+"    bx    lr\n"
+    );
+
 /**
  * @brief  USB_OTG_WritePacket : Writes a packet into the Tx FIFO associated
  *         with the EP
@@ -123,6 +151,18 @@ USB_OTG_STS USB_OTG_WritePacket(USB_OTG_CORE_HANDLE *pdev,
 
     count32b = (len + 3) / 4;
     fifo = pdev->regs.DFIFO[ch_ep_num];
+
+    /* Bulk of an aligned packet in 32-byte bursts. */
+    if (!((uint32_t)src & 3) && (count32b >= 8)) {
+        i = (count32b & ~7) * 4;
+        fifo_write_fast(fifo, src, i);
+        src += i;
+        count32b &= 7;
+    }
+
+    /* Unaligned source, or remainder. Cortex-M3/M4 permit unaligned LDR.
+     * The final word may include up to three bytes beyond the packet,
+     * which the core ignores. */
     for (i = 0; i < count32b; i++) {
         USB_OTG_WRITE_REG32(fifo, *(uint32_t *)src);
         src += 4;
@@ -143,15 +183,35 @@ void *USB_OTG_ReadPacket(USB_OTG_CORE_HANDLE *pdev,
                          uint8_t *dest,
                          uint16_t len)
 {
-    uint32_t i;
-    uint32_t count32b = (len + 3) / 4;
+    uint32_t i, x;
+    uint32_t count32b = len / 4;
     __IO uint32_t *fifo = pdev->regs.DFIFO[0];
 
+    /* Bulk of an aligned packet in 32-byte bursts. */
+    if (!((uint32_t)dest & 3) && (count32b >= 8)) {
+        i = (count32b & ~7) * 4;
+        fifo_read_fast(dest, fifo, i);
+        dest += i;
+        count32b &= 7;
+    }
+
+    /* Unaligned destination, or remainder. Cortex-M3/M4 permit unaligned
+     * STR. */
     for (i = 0; i < count32b; i++) {
         *(uint32_t *)dest = USB_OTG_READ_REG32(fifo);
         dest += 4;
     }
 
+    /* Trailing bytes: pop the final word but store only what was asked
+     * for, so as not to overrun the destination. */
+    if ((len &= 3) != 0) {
+        x = USB_OTG_READ_REG32(fifo);
+        while (len--) {
+            *dest++ = (uint8_t)x;
+            x >>= 8;
+        }
+    }
+
     return ((void *)dest);
 }
 
@@ -812,17 +872,28 @@ uint32_t USB_OTG_ReadHostAllChannels_intr (USB_OTG_CORE_HANDLE *pdev)
  *   before clearing the reset bit.
  */
 uint32_t USB_OTG_ResetPort(USB_OTG_CORE_HANDLE *pdev)
+{
+    USB_OTG_DrivePortReset(pdev, 1);
+    USB_OTG_BSP_mDelay (100);                                /* See Note #1 */
+    USB_OTG_DrivePortReset(pdev, 0);
+    USB_OTG_BSP_mDelay (20);
+    return 1;
+}
+
+/**
+ * @brief  USB_OTG_DrivePortReset : Assert or release Host Port reset. The
+ *         caller is responsible for the timing of USB_OTG_ResetPort().
+ * @param  pdev : Selected device
+ * @param  state : 1 to assert reset, 0 to release
+ * @retval None
+ */
+void USB_OTG_DrivePortReset(USB_OTG_CORE_HANDLE *pdev, uint8_t state)
 {
     USB_OTG_HPRT0_TypeDef  hprt0;
 
     hprt0.d32 = USB_OTG_ReadHPRT0(pdev);
-    hprt0.b.prtrst = 1;
+    hprt0.b.prtrst = state;
     USB_OTG_WRITE_REG32(pdev->regs.HPRT0, hprt0.d32);
-    USB_OTG_BSP_mDelay (100);                                /* See Note #1 */
-    hprt0.b.prtrst = 0;
-    USB_OTG_WRITE_REG32(pdev->regs.HPRT0, hprt0.d32);
-    USB_OTG_BSP_mDelay (20);
-    return 1;
 }
 
 
@@ -947,7 +1018,6 @@ USB_OTG_STS USB_OTG_HC_StartXfer(USB_OTG_CORE_HANDLE *pdev , uint8_t hc_num)
     USB_OTG_STS status = USB_OTG_OK;
     USB_OTG_HCCHAR_TypeDef   hcchar;
     USB_OTG_HCTSIZn_TypeDef  hctsiz;
-    USB_OTG_HNPTXSTS_TypeDef hnptxsts;
     USB_OTG_HPTXSTS_TypeDef  hptxsts;
     USB_OTG_GINTMSK_TypeDef  intmsk;
     uint16_t                 len_words = 0;
@@ -982,6 +1052,7 @@ USB_OTG_STS USB_OTG_HC_StartXfer(USB_OTG_CORE_HANDLE *pdev , uint8_t hc_num)
         pdev->host.hc[hc_num].xfer_len = num_packets * \
             pdev->host.hc[hc_num].max_packet;
     }
+    pdev->host.hc[hc_num].xfer_pkts = num_packets;
     /* Initialize the HCTSIZn register */
     hctsiz.b.xfersize = pdev->host.hc[hc_num].xfer_len;
     hctsiz.b.pktcnt = num_packets;
@@ -994,6 +1065,9 @@ USB_OTG_STS USB_OTG_HC_StartXfer(USB_OTG_CORE_HANDLE *pdev , uint8_t hc_num)
     }
 
 
+    usb_trace_ev(hc_num | (pdev->host.hc[hc_num].ep_is_in ? USB_TRACE_IN : 0),
+                 USB_TRACE_START, pdev->host.hc[hc_num].xfer_len);
+
     hcchar.d32 = USB_OTG_READ_REG32(&pdev->regs.HC_REGS[hc_num]->HCCHAR);
     hcchar.b.oddfrm = USB_OTG_IsEvenFrame(pdev);
 
@@ -1013,13 +1087,11 @@ USB_OTG_STS USB_OTG_HC_StartXfer(USB_OTG_CORE_HANDLE *pdev , uint8_t hc_num)
             case EP_TYPE_CTRL:
             case EP_TYPE_BULK:
 
-                hnptxsts.d32 = USB_OTG_READ_REG32(&pdev->regs.GREGS->HNPTXSTS);
-                len_words = (pdev->host.hc[hc_num].xfer_len + 3) / 4;
-
-                /* check if there is enough space in FIFO space */
-                if(len_words > hnptxsts.b.nptxfspcavail)
+                /* Write as many whole packets as fit now. Multi-packet
+                 * transfers are completed by the nptxfempty interrupt. */
+                if (USB_OTG_HC_WriteNPTxFifo(pdev, hc_num) != 0)
                 {
-                    /* need to process data in nptxfempty interrupt */
+                    pdev->host.NPTxPending |= 1u << hc_num;
                     intmsk.b.nptxfempty = 1;
                     USB_OTG_MODIFY_REG32( &pdev->regs.GREGS->GINTMSK, 0, intmsk.d32);
                 }
@@ -1037,21 +1109,53 @@ USB_OTG_STS USB_OTG_HC_StartXfer(USB_OTG_CORE_HANDLE *pdev , uint8_t hc_num)
                     intmsk.b.ptxfempty = 1;
                     USB_OTG_MODIFY_REG32( &pdev->regs.GREGS->GINTMSK, 0, intmsk.d32);
                 }
+
+                /* Write packet into the Tx FIFO. */
+                USB_OTG_WritePacket(pdev,
+                                    pdev->host.hc[hc_num].xfer_buff ,
+                                    hc_num, pdev->host.hc[hc_num].xfer_len);
                 break;
 
             default:
                 break;
             }
-
-            /* Write packet into the Tx FIFO. */
-            USB_OTG_WritePacket(pdev,
-                                pdev->host.hc[hc_num].xfer_buff ,
-                                hc_num, pdev->host.hc[hc_num].xfer_len);
         }
     }
     return status;
 }
 
+/**
+ * @brief  USB_OTG_HC_WriteNPTxFifo : Write whole packets of a non-periodic
+ *         OUT transfer into the Tx FIFO, for as long as there is space in
+ *         both the FIFO and the request queue
+ * @param  pdev : Selected device
+ * @param  hc_num : channel number
+ * @retval Number of bytes still to be written
+ */
+uint32_t USB_OTG_HC_WriteNPTxFifo(USB_OTG_CORE_HANDLE *pdev , uint8_t hc_num)
+{
+    USB_OTG_HC *hc = &pdev->host.hc[hc_num];
+    USB_OTG_HNPTXSTS_TypeDef hnptxsts;
+    uint16_t len;
+
+    while (hc->xfer_len != 0)
+    {
+        len = min_t(uint32_t, hc->xfer_len, hc->max_packet);
+        hnptxsts.d32 = USB_OTG_READ_REG32(&pdev->regs.GREGS->HNPTXSTS);
+        if ((hnptxsts.b.nptxfspcavail < (len + 3) / 4) ||
+            (hnptxsts.b.nptxqspcavail == 0))
+        {
+            break;
+        }
+        USB_OTG_WritePacket(pdev, hc->xfer_buff, hc_num, len);
+        hc->xfer_buff  += len;
+        hc->xfer_len   -= len;
+        hc->xfer_count += len;
+    }
+
+    return hc->xfer_len;
+}
+
 
 /**
  * @brief  USB_OTG_HC_Halt : Halt channel
@@ -42,12 +42,17 @@ uint32_t HCD_Init(USB_OTG_CORE_HANDLE *pdev ,
 {
     uint8_t i = 0;
     pdev->host.ConnSts = 0;
+    pdev->host.NPTxPending = 0;
+    pdev->host.URB_EvtProd = pdev->host.URB_EvtCons = 0;
+    pdev->host.URB_EvtOverflow = 0;
+    memset(pdev->host.Stats, 0, sizeof(pdev->host.Stats));
 
     for (i= 0; i< USB_OTG_MAX_TX_FIFOS; i++)
     {
         pdev->host.ErrCnt[i]  = 0;
         pdev->host.XferCnt[i]   = 0;
         pdev->host.HC_Status[i]   = HC_IDLE;
+        pdev->host.URB_Cb[i]   = NULL;
     }
     pdev->host.hc[0].max_packet  = 8;
 
@@ -100,6 +105,19 @@ uint32_t HCD_ResetPort(USB_OTG_CORE_HANDLE *pdev)
     return 0;
 }
 
+/**
+ * @brief  HCD_DrivePortReset
+ *         Assert or release port reset, for a caller which times the reset
+ *         itself rather than blocking in HCD_ResetPort()
+ * @param  pdev : Selected device
+ * @param  state : 1 to assert reset, 0 to release
+ * @retval None
+ */
+void HCD_DrivePortReset(USB_OTG_CORE_HANDLE *pdev, uint8_t state)
+{
+    USB_OTG_DrivePortReset(pdev, state);
+}
+
 /**
  * @brief  HCD_IsDeviceConnected
  *         Check if the device is connected.
@@ -149,6 +167,39 @@ URB_STATE HCD_GetURB_State (USB_OTG_CORE_HANDLE *pdev , uint8_t ch_num)
     return pdev->host.URB_State[ch_num] ;
 }
 
+/**
+ * @brief  HCD_GetURB_Event
+ *         Dequeue the next URB completion event. Must be called from one
+ *         context only (the event consumer).
+ * @param  pdev: Selected device
+ * @param  ch_num: Returns the channel number, or URB_EVT_ANY if events
+ *         were lost and all channels should be checked
+ * @retval 1 if an event was dequeued, else 0
+ *
+ */
+uint8_t HCD_GetURB_Event (USB_OTG_CORE_HANDLE *pdev, uint8_t *ch_num)
+{
+    uint8_t cons = pdev->host.URB_EvtCons;
+
+    if (pdev->host.URB_EvtOverflow)
+    {
+        pdev->host.URB_EvtOverflow = 0;
+        *ch_num = URB_EVT_ANY;
+        return 1;
+    }
+
+    if (cons == pdev->host.URB_EvtProd)
+    {
+        return 0;
+    }
+
+    barrier(); /* read prod before the event */
+    *ch_num = pdev->host.URB_Evt[cons & (URB_EVT_QUEUE_LEN - 1)];
+    barrier(); /* read the event before releasing its slot */
+    pdev->host.URB_EvtCons = cons + 1;
+    return 1;
+}
+
 /**
  * @brief  HCD_GetXferCnt
  *         This function returns the last URBstate
@@ -197,6 +248,11 @@ uint32_t HCD_HC_Init (USB_OTG_CORE_HANDLE *pdev , uint8_t hc_num)
 uint32_t HCD_SubmitRequest (USB_OTG_CORE_HANDLE *pdev , uint8_t hc_num)
 {
 
+    if ((pdev->host.URB_State[hc_num] == URB_NOTREADY) ||
+        (pdev->host.URB_State[hc_num] == URB_ERROR))
+    {
+        pdev->host.Stats[hc_num].retries++;
+    }
     pdev->host.URB_State[hc_num] =   URB_IDLE;
     pdev->host.hc[hc_num].xfer_count = 0 ;
     return USB_OTG_HC_StartXfer(pdev, hc_num);
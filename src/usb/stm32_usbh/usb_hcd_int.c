@@ -28,6 +28,8 @@
 #include "usb_core.h"
 #include "usb_defines.h"
 #include "usb_hcd_int.h"
+#include "usb_bsp.h"
+#include "usb_trace.h"
 
 static uint32_t USB_OTG_USBH_handle_sof_ISR(USB_OTG_CORE_HANDLE *pdev);
 static uint32_t USB_OTG_USBH_handle_port_ISR(USB_OTG_CORE_HANDLE *pdev);
@@ -41,6 +43,8 @@ static uint32_t USB_OTG_USBH_handle_nptxfempty_ISR (USB_OTG_CORE_HANDLE *pdev);
 static uint32_t USB_OTG_USBH_handle_ptxfempty_ISR (USB_OTG_CORE_HANDLE *pdev);
 static uint32_t USB_OTG_USBH_handle_Disconnect_ISR (USB_OTG_CORE_HANDLE *pdev);
 static uint32_t USB_OTG_USBH_handle_IncompletePeriodicXfer_ISR (USB_OTG_CORE_HANDLE *pdev);
+static void USB_OTG_USBH_URB_Complete (USB_OTG_CORE_HANDLE *pdev,
+                                       uint32_t num);
 
 /**
  * @brief  HOST_Handle_ISR
@@ -199,38 +203,23 @@ static uint32_t USB_OTG_USBH_handle_Disconnect_ISR (USB_OTG_CORE_HANDLE *pdev)
 static uint32_t USB_OTG_USBH_handle_nptxfempty_ISR (USB_OTG_CORE_HANDLE *pdev)
 {
     USB_OTG_GINTMSK_TypeDef      intmsk;
-    USB_OTG_HNPTXSTS_TypeDef     hnptxsts = { 0 };
-    uint16_t                     len_words, len;
-
-    hnptxsts.d32 = USB_OTG_READ_REG32(&pdev->regs.GREGS->HNPTXSTS);
-
-    len_words = (pdev->host.hc[hnptxsts.b.nptxqtop.chnum].xfer_len + 3) / 4;
+    uint32_t                     pending = pdev->host.NPTxPending;
+    uint8_t                      num;
 
-    while ((hnptxsts.b.nptxfspcavail > len_words)&&
-           (pdev->host.hc[hnptxsts.b.nptxqtop.chnum].xfer_len != 0))
+    /* Continue writing packets for every channel still waiting on space. */
+    for (num = 0; pending != 0; num++, pending >>= 1)
     {
-
-        len = hnptxsts.b.nptxfspcavail * 4;
-
-        if (len > pdev->host.hc[hnptxsts.b.nptxqtop.chnum].xfer_len)
+        if ((pending & 1) && (USB_OTG_HC_WriteNPTxFifo(pdev, num) == 0))
         {
-            /* Last packet */
-            len = pdev->host.hc[hnptxsts.b.nptxqtop.chnum].xfer_len;
-
-            intmsk.d32 = 0;
-            intmsk.b.nptxfempty = 1;
-            USB_OTG_MODIFY_REG32( &pdev->regs.GREGS->GINTMSK, intmsk.d32, 0);
+            pdev->host.NPTxPending &= ~(1u << num);
         }
+    }
 
-        len_words = (pdev->host.hc[hnptxsts.b.nptxqtop.chnum].xfer_len + 3) / 4;
-
-        USB_OTG_WritePacket (pdev , pdev->host.hc[hnptxsts.b.nptxqtop.chnum].xfer_buff, hnptxsts.b.nptxqtop.chnum, len);
-
-        pdev->host.hc[hnptxsts.b.nptxqtop.chnum].xfer_buff  += len;
-        pdev->host.hc[hnptxsts.b.nptxqtop.chnum].xfer_len   -= len;
-        pdev->host.hc[hnptxsts.b.nptxqtop.chnum].xfer_count  += len;
-
-        hnptxsts.d32 = USB_OTG_READ_REG32(&pdev->regs.GREGS->HNPTXSTS);
+    if (pdev->host.NPTxPending == 0)
+    {
+        intmsk.d32 = 0;
+        intmsk.b.nptxfempty = 1;
+        USB_OTG_MODIFY_REG32( &pdev->regs.GREGS->GINTMSK, intmsk.d32, 0);
     }
 
     return 1;
@@ -393,6 +382,8 @@ uint32_t USB_OTG_USBH_handle_hc_n_Out_ISR (USB_OTG_CORE_HANDLE *pdev , uint32_t
     USB_OTG_HCINTMSK_TypeDef  hcintmsk;
     USB_OTG_HC_REGS *hcreg;
     USB_OTG_HCCHAR_TypeDef     hcchar;
+    USB_OTG_HCTSIZn_TypeDef    hctsiz;
+    uint32_t                   pkts;
 
     hcreg = pdev->regs.HC_REGS[num];
     hcint.d32 = USB_OTG_READ_REG32(&hcreg->HCINT);
@@ -409,12 +400,14 @@ uint32_t USB_OTG_USBH_handle_hc_n_Out_ISR (USB_OTG_CORE_HANDLE *pdev , uint32_t
     else if (hcint.b.ack)
     {
         CLEAR_HC_INT(hcreg , ack);
+        usb_trace_ev(num, USB_TRACE_ACK, 0);
     }
     else if (hcint.b.frmovrun)
     {
         UNMASK_HOST_INT_CHH (num);
         USB_OTG_HC_Halt(pdev, num);
         CLEAR_HC_INT(hcreg ,frmovrun);
+        usb_trace_ev(num, USB_TRACE_FRMOVRUN, 0);
     }
     else if (hcint.b.xfercompl)
     {
@@ -422,12 +415,15 @@ uint32_t USB_OTG_USBH_handle_hc_n_Out_ISR (USB_OTG_CORE_HANDLE *pdev , uint32_t
         UNMASK_HOST_INT_CHH (num);
         USB_OTG_HC_Halt(pdev, num);
         CLEAR_HC_INT(hcreg , xfercompl);
+        usb_trace_ev(num, USB_TRACE_XFRC, 0);
         pdev->host.HC_Status[num] = HC_XFRC;
     }
 
     else if (hcint.b.stall)
     {
         CLEAR_HC_INT(hcreg , stall);
+        usb_trace_ev(num, USB_TRACE_STALL, 0);
+        pdev->host.Stats[num].stall++;
         UNMASK_HOST_INT_CHH (num);
         USB_OTG_HC_Halt(pdev, num);
         pdev->host.HC_Status[num] = HC_STALL;
@@ -442,6 +438,8 @@ uint32_t USB_OTG_USBH_handle_hc_n_Out_ISR (USB_OTG_CORE_HANDLE *pdev , uint32_t
             USB_OTG_HC_Halt(pdev, num);
         }
         CLEAR_HC_INT(hcreg , nak);
+        usb_trace_ev(num, USB_TRACE_NAK, 1);
+        pdev->host.Stats[num].nak++;
         pdev->host.HC_Status[num] = HC_NAK;
     }
 
@@ -451,6 +449,8 @@ uint32_t USB_OTG_USBH_handle_hc_n_Out_ISR (USB_OTG_CORE_HANDLE *pdev , uint32_t
         USB_OTG_HC_Halt(pdev, num);
         pdev->host.HC_Status[num] = HC_XACTERR;
         CLEAR_HC_INT(hcreg , xacterr);
+        usb_trace_ev(num, USB_TRACE_XACTERR, 0);
+        pdev->host.Stats[num].xacterr++;
     }
     else if (hcint.b.nyet)
     {
@@ -461,6 +461,8 @@ uint32_t USB_OTG_USBH_handle_hc_n_Out_ISR (USB_OTG_CORE_HANDLE *pdev , uint32_t
             USB_OTG_HC_Halt(pdev, num);
         }
         CLEAR_HC_INT(hcreg , nyet);
+        usb_trace_ev(num, USB_TRACE_NYET, 0);
+        pdev->host.Stats[num].nyet++;
         pdev->host.HC_Status[num] = HC_NYET;
     }
     else if (hcint.b.datatglerr)
@@ -471,10 +473,24 @@ uint32_t USB_OTG_USBH_handle_hc_n_Out_ISR (USB_OTG_CORE_HANDLE *pdev , uint32_t
         pdev->host.HC_Status[num] = HC_DATATGLERR;
 
         CLEAR_HC_INT(hcreg , datatglerr);
+        usb_trace_ev(num, USB_TRACE_DATATGLERR, 0);
+        pdev->host.Stats[num].datatglerr++;
     }
     else if (hcint.b.chhltd)
     {
         MASK_HOST_INT_CHH (num);
+        pdev->host.NPTxPending &= ~(1u << num);
+
+        /* Packets acknowledged before the channel halted: a multi-packet
+         * transfer may be cut short by a NAK. */
+        hctsiz.d32 = USB_OTG_READ_REG32(&hcreg->HCTSIZ);
+        pkts = pdev->host.hc[num].xfer_pkts - hctsiz.b.pktcnt;
+        pdev->host.XferCnt[num] = min_t(uint32_t,
+                                        pkts * pdev->host.hc[num].max_packet,
+                                        pdev->host.hc[num].xfer_count +
+                                        pdev->host.hc[num].xfer_len);
+        usb_trace_ev(num, USB_TRACE_HALT, pdev->host.XferCnt[num]);
+        pdev->host.Stats[num].bytes += pdev->host.XferCnt[num];
 
         if(pdev->host.HC_Status[num] == HC_XFRC)
         {
@@ -482,12 +498,17 @@ uint32_t USB_OTG_USBH_handle_hc_n_Out_ISR (USB_OTG_CORE_HANDLE *pdev , uint32_t
 
             if (hcchar.b.eptype == EP_TYPE_BULK)
             {
-                pdev->host.hc[num].toggle_out ^= 1;
+                pdev->host.hc[num].toggle_out ^= pkts & 1;
             }
         }
         else if(pdev->host.HC_Status[num] == HC_NAK)
         {
             pdev->host.URB_State[num] = URB_NOTREADY;
+
+            if (hcchar.b.eptype == EP_TYPE_BULK)
+            {
+                pdev->host.hc[num].toggle_out ^= pkts & 1;
+            }
         }
         else if(pdev->host.HC_Status[num] == HC_NYET)
         {
@@ -508,12 +529,47 @@ uint32_t USB_OTG_USBH_handle_hc_n_Out_ISR (USB_OTG_CORE_HANDLE *pdev , uint32_t
             }
         }
         CLEAR_HC_INT(hcreg , chhltd);
+        USB_OTG_USBH_URB_Complete(pdev, num);
     }
 
 
     return 1;
 }
 
+/**
+ * @brief  USB_OTG_USBH_URB_Complete
+ *         Run the channel's completion hook, then queue a completion event
+ *         for the class driver
+ * @param  pdev: Selected device
+ * @param  num: Channel number
+ * @retval None
+ */
+static void USB_OTG_USBH_URB_Complete (USB_OTG_CORE_HANDLE *pdev, uint32_t num)
+{
+    uint8_t prod = pdev->host.URB_EvtProd;
+
+    usb_trace_ev(num | (pdev->host.hc[num].ep_is_in ? USB_TRACE_IN : 0),
+                 USB_TRACE_URB, pdev->host.URB_State[num]);
+
+    if (pdev->host.URB_Cb[num] != NULL)
+    {
+        pdev->host.URB_Cb[num](pdev, num);
+    }
+
+    if ((uint8_t)(prod - pdev->host.URB_EvtCons) < URB_EVT_QUEUE_LEN)
+    {
+        pdev->host.URB_Evt[prod & (URB_EVT_QUEUE_LEN - 1)] = num;
+        barrier(); /* write the event before publishing it */
+        pdev->host.URB_EvtProd = prod + 1;
+    }
+    else
+    {
+        pdev->host.URB_EvtOverflow = 1;
+    }
+
+    USB_OTG_BSP_NotifyURB(pdev);
+}
+
 /**
  * @brief  USB_OTG_USBH_handle_hc_n_In_ISR
  *         Handles interrupt for a specific Host Channel
@@ -544,6 +600,7 @@ uint32_t USB_OTG_USBH_handle_hc_n_In_ISR (USB_OTG_CORE_HANDLE *pdev , uint32_t n
     else if (hcint.b.ack)
     {
         CLEAR_HC_INT(hcreg ,ack);
+        usb_trace_ev(num | USB_TRACE_IN, USB_TRACE_ACK, 0);
     }
 
     else if (hcint.b.stall)
@@ -552,6 +609,8 @@ uint32_t USB_OTG_USBH_handle_hc_n_In_ISR (USB_OTG_CORE_HANDLE *pdev , uint32_t n
         pdev->host.HC_Status[num] = HC_STALL;
         CLEAR_HC_INT(hcreg , nak);   /* Clear the NAK Condition */
         CLEAR_HC_INT(hcreg , stall); /* Clear the STALL Condition */
+        usb_trace_ev(num | USB_TRACE_IN, USB_TRACE_STALL, 0);
+        pdev->host.Stats[num].stall++;
         hcint.b.nak = 0;           /* NOTE: When there is a 'stall', reset also nak,
                                       else, the pdev->host.HC_Status = HC_STALL
                                       will be overwritten by 'nak' in code below */
@@ -564,6 +623,18 @@ uint32_t USB_OTG_USBH_handle_hc_n_In_ISR (USB_OTG_CORE_HANDLE *pdev , uint32_t n
         CLEAR_HC_INT(hcreg , nak);
         pdev->host.HC_Status[num] = HC_DATATGLERR;
         CLEAR_HC_INT(hcreg , datatglerr);
+        usb_trace_ev(num | USB_TRACE_IN, USB_TRACE_DATATGLERR, 0);
+        pdev->host.Stats[num].datatglerr++;
+    }
+    else if (hcint.b.bblerr)
+    {
+        /* Babble: the device sent more than max_packet. */
+        UNMASK_HOST_INT_CHH (num);
+        USB_OTG_HC_Halt(pdev, num);
+        pdev->host.HC_Status[num] = HC_BBLERR;
+        CLEAR_HC_INT(hcreg , bblerr);
+        usb_trace_ev(num | USB_TRACE_IN, USB_TRACE_BBLERR, 0);
+        pdev->host.Stats[num].bblerr++;
     }
 
     if (hcint.b.frmovrun)
@@ -571,6 +642,7 @@ uint32_t USB_OTG_USBH_handle_hc_n_In_ISR (USB_OTG_CORE_HANDLE *pdev , uint32_t n
         UNMASK_HOST_INT_CHH (num);
         USB_OTG_HC_Halt(pdev, num);
         CLEAR_HC_INT(hcreg ,frmovrun);
+        usb_trace_ev(num | USB_TRACE_IN, USB_TRACE_FRMOVRUN, 0);
     }
 
     else if (hcint.b.xfercompl)
@@ -584,9 +656,9 @@ uint32_t USB_OTG_USBH_handle_hc_n_In_ISR (USB_OTG_CORE_HANDLE *pdev , uint32_t n
         pdev->host.HC_Status[num] = HC_XFRC;
         pdev->host.ErrCnt [num]= 0;
         CLEAR_HC_INT(hcreg , xfercompl);
+        usb_trace_ev(num | USB_TRACE_IN, USB_TRACE_XFRC, 0);
 
-        if ((hcchar.b.eptype == EP_TYPE_CTRL)||
-            (hcchar.b.eptype == EP_TYPE_BULK))
+        if (hcchar.b.eptype == EP_TYPE_CTRL)
         {
             UNMASK_HOST_INT_CHH (num);
             USB_OTG_HC_Halt(pdev, num);
@@ -594,6 +666,13 @@ uint32_t USB_OTG_USBH_handle_hc_n_In_ISR (USB_OTG_CORE_HANDLE *pdev , uint32_t n
             pdev->host.hc[num].toggle_in ^= 1;
 
         }
+        else if (hcchar.b.eptype == EP_TYPE_BULK)
+        {
+            /* Bulk IN toggles once per packet, in the rx_qlvl handler. */
+            UNMASK_HOST_INT_CHH (num);
+            USB_OTG_HC_Halt(pdev, num);
+            CLEAR_HC_INT(hcreg , nak);
+        }
         else if(hcchar.b.eptype == EP_TYPE_INTR)
         {
             hcchar.b.oddfrm  = 1;
@@ -604,6 +683,9 @@ uint32_t USB_OTG_USBH_handle_hc_n_In_ISR (USB_OTG_CORE_HANDLE *pdev , uint32_t n
     else if (hcint.b.chhltd)
     {
         MASK_HOST_INT_CHH (num);
+        usb_trace_ev(num | USB_TRACE_IN, USB_TRACE_HALT,
+                     pdev->host.hc[num].xfer_count);
+        pdev->host.Stats[num].bytes += pdev->host.hc[num].xfer_count;
 
         if(pdev->host.HC_Status[num] == HC_XFRC)
         {
@@ -616,7 +698,8 @@ uint32_t USB_OTG_USBH_handle_hc_n_In_ISR (USB_OTG_CORE_HANDLE *pdev , uint32_t n
         }
 
         else if((pdev->host.HC_Status[num] == HC_XACTERR) ||
-                (pdev->host.HC_Status[num] == HC_DATATGLERR))
+                (pdev->host.HC_Status[num] == HC_DATATGLERR) ||
+                (pdev->host.HC_Status[num] == HC_BBLERR))
         {
             pdev->host.ErrCnt[num] = 0;
             pdev->host.URB_State[num] = URB_ERROR;
@@ -628,6 +711,7 @@ uint32_t USB_OTG_USBH_handle_hc_n_In_ISR (USB_OTG_CORE_HANDLE *pdev , uint32_t n
         }
 
         CLEAR_HC_INT(hcreg , chhltd);
+        USB_OTG_USBH_URB_Complete(pdev, num);
 
     }
     else if (hcint.b.xacterr)
@@ -636,6 +720,8 @@ uint32_t USB_OTG_USBH_handle_hc_n_In_ISR (USB_OTG_CORE_HANDLE *pdev , uint32_t n
         pdev->host.HC_Status[num] = HC_XACTERR;
         USB_OTG_HC_Halt(pdev, num);
         CLEAR_HC_INT(hcreg , xacterr);
+        usb_trace_ev(num | USB_TRACE_IN, USB_TRACE_XACTERR, 0);
+        pdev->host.Stats[num].xacterr++;
     }
     else if (hcint.b.nak)
     {
@@ -650,6 +736,8 @@ uint32_t USB_OTG_USBH_handle_hc_n_In_ISR (USB_OTG_CORE_HANDLE *pdev , uint32_t n
 
         pdev->host.HC_Status[num] = HC_NAK;
         CLEAR_HC_INT(hcreg , nak);
+        usb_trace_ev(num | USB_TRACE_IN, USB_TRACE_NAK, 1);
+        pdev->host.Stats[num].nak++;
 
         if  ((hcchar.b.eptype == EP_TYPE_CTRL)||
              (hcchar.b.eptype == EP_TYPE_BULK))
@@ -693,6 +781,13 @@ static uint32_t USB_OTG_USBH_handle_rx_qlvl_ISR (USB_OTG_CORE_HANDLE *pdev)
     switch (grxsts.b.pktsts)
     {
     case GRXSTS_PKTSTS_IN:
+        /* Every bulk data packet, including zero-length, flips the toggle:
+         * a multi-packet URB may complete with either parity. */
+        if (hcchar.b.eptype == EP_TYPE_BULK)
+        {
+            pdev->host.hc[channelnum].toggle_in ^= 1;
+        }
+
         /* Read the data into the host buffer. */
         if ((grxsts.b.bcnt > 0) && (pdev->host.hc[channelnum].xfer_buff != (void  *)0))
         {
@@ -707,9 +802,11 @@ static uint32_t USB_OTG_USBH_handle_rx_qlvl_ISR (USB_OTG_CORE_HANDLE *pdev)
             pdev->host.XferCnt[channelnum]  = count;
 
             hctsiz.d32 = USB_OTG_READ_REG32(&pdev->regs.HC_REGS[channelnum]->HCTSIZ);
-            if(hctsiz.b.pktcnt > 0)
+            if((hctsiz.b.pktcnt > 0) &&
+               (grxsts.b.bcnt == pdev->host.hc[channelnum].max_packet))
             {
-                /* re-activate the channel when more packets are expected */
+                /* re-activate the channel when more packets are expected:
+                 * a short packet terminates the transfer */
                 hcchar.b.chen = 1;
                 hcchar.b.chdis = 0;
                 USB_OTG_WRITE_REG32(&pdev->regs.HC_REGS[channelnum]->HCCHAR, hcchar.d32);
@@ -21,6 +21,30 @@
 
 CDC_HandleTypeDef _CDC_Handle;
 
+/* Device on which the data channels are open: data transfers are submitted
+ * directly by the API calls and by the completion handlers. */
+static USB_OTG_CORE_HANDLE *CDC_Dev;
+
+/* Streaming reception. IN packets land directly in a ring of InEpSize slots,
+ * and the IN channel is re-armed from the URB completion interrupt so that
+ * reception never waits on the main loop. prod is advanced only in IRQ
+ * context; cons only by the consumer. */
+#define CDC_STREAM_MAX_SLOTS 64U
+
+static struct
+{
+  uint8_t              *buf;
+  uint16_t             len[CDC_STREAM_MAX_SLOTS];
+  uint16_t             nr_slots;   /* power of two */
+  uint16_t             slot_size;
+  uint16_t             cons_off;   /* bytes already consumed from slot cons */
+  __IO uint16_t        prod, cons; /* free-running slot indexes */
+  __IO uint16_t        armed;      /* slots covered by the in-flight URB */
+  __IO uint8_t         active;
+  __IO uint8_t         error;
+}
+CDC_Stream;
+
 static USBH_Status USBH_CDC_InterfaceInit  (USB_OTG_CORE_HANDLE *pdev ,
                                             void *phost);
 
@@ -39,6 +63,17 @@ static void CDC_ProcessTransmission(USB_OTG_CORE_HANDLE *pdev ,
 static void CDC_ProcessReception(USB_OTG_CORE_HANDLE *pdev ,
                                  void   *phost);
 
+static void CDC_TransmitEvent(USB_OTG_CORE_HANDLE *pdev);
+static USBH_Status CDC_SetLineCodingReq(USB_OTG_CORE_HANDLE *pdev,
+                                        USBH_HOST *phost);
+static void CDC_ReceiveEvent(USB_OTG_CORE_HANDLE *pdev);
+
+static void CDC_SubmitTransmission(USB_OTG_CORE_HANDLE *pdev);
+static void CDC_TransmitComplete(USB_OTG_CORE_HANDLE *pdev, uint8_t hc_num);
+
+static void CDC_StreamArm(void);
+static void CDC_StreamComplete(USB_OTG_CORE_HANDLE *pdev, uint8_t hc_num);
+
 USBH_Class_cb_TypeDef  USBH_CDC_cb =
 {
     USBH_CDC_InterfaceInit,
@@ -92,11 +127,16 @@ static USBH_Status USBH_CDC_InterfaceInit ( USB_OTG_CORE_HANDLE *pdev,
         _CDC_Handle.DataItf.OutEpSize  = pphost->device_prop.Ep_Desc[1][1].wMaxPacketSize;
     }
 
+    CDC_Dev = pdev;
+
     _CDC_Handle.DataItf.OutPipe = USBH_Alloc_Channel(pdev,
                                                 _CDC_Handle.DataItf.OutEp);
     _CDC_Handle.DataItf.InPipe = USBH_Alloc_Channel(pdev,
                                                _CDC_Handle.DataItf.InEp);
 
+    /* Multi-packet transmissions continue from the completion interrupt. */
+    pdev->host.URB_Cb[_CDC_Handle.DataItf.OutPipe] = CDC_TransmitComplete;
+
     /* Open the new channels */
     USBH_Open_Channel  (pdev,
                         _CDC_Handle.DataItf.OutPipe,
@@ -125,8 +165,14 @@ static USBH_Status USBH_CDC_InterfaceInit ( USB_OTG_CORE_HANDLE *pdev,
 void USBH_CDC_InterfaceDeInit ( USB_OTG_CORE_HANDLE *pdev,
                                 void *phost)
 {	
+    USBH_CDC_StreamStop();
+
+    _CDC_Handle.data_tx_state = CDC_IDLE;
+    _CDC_Handle.data_rx_state = CDC_IDLE;
+
     if ( _CDC_Handle.DataItf.OutPipe)
     {
+        pdev->host.URB_Cb[_CDC_Handle.DataItf.OutPipe] = NULL;
         USB_OTG_HC_Halt(pdev, _CDC_Handle.DataItf.OutPipe);
         USBH_Free_Channel  (pdev, _CDC_Handle.DataItf.OutPipe);
         _CDC_Handle.DataItf.OutPipe = 0;     /* Reset the Channel as Free */
@@ -174,6 +220,7 @@ static USBH_Status USBH_CDC_Handle(USB_OTG_CORE_HANDLE *pdev ,
 {
     CDC_HandleTypeDef *CDC_Handle = (CDC_HandleTypeDef *)&_CDC_Handle;
     USBH_Status status = USBH_BUSY;
+    USBH_Status req_status;
 
     if(HCD_IsDeviceConnected(pdev))
     {
@@ -184,6 +231,20 @@ static USBH_Status USBH_CDC_Handle(USB_OTG_CORE_HANDLE *pdev ,
             status = USBH_OK;
             break;
 
+        case CDC_SET_LINE_CODING_STATE:
+            req_status = CDC_SetLineCodingReq(pdev, phost);
+            if (req_status == USBH_OK)
+            {
+                CDC_Handle->state = CDC_TRANSFER_DATA;
+                USBH_CDC_LineCodingChanged();
+            }
+            else if (req_status != USBH_BUSY)
+            {
+                /* Failed: the caller times out. */
+                CDC_Handle->state = CDC_TRANSFER_DATA;
+            }
+            break;
+
         case CDC_TRANSFER_DATA:
             CDC_ProcessTransmission(pdev, phost);
             CDC_ProcessReception(pdev, phost);
@@ -197,22 +258,136 @@ static USBH_Status USBH_CDC_Handle(USB_OTG_CORE_HANDLE *pdev ,
     return status;
 }
 
+/**
+  * @brief  Issue a SET_LINE_CODING request on the control pipe. Completion
+  *         is signalled by USBH_CDC_LineCodingChanged().
+  * @param  phost: Selected host
+  * @param  linecoding: Line coding, which must remain valid until completion
+  * @retval Status
+  */
+USBH_Status  USBH_CDC_SetLineCoding(USBH_HOST *phost,
+                                    CDC_LineCodingTypeDef *linecoding)
+{
+  CDC_HandleTypeDef *CDC_Handle = (CDC_HandleTypeDef *)&_CDC_Handle;
+
+  if ((phost->gState != HOST_CLASS)
+      || ((CDC_Handle->state != CDC_IDLE_STATE)
+          && (CDC_Handle->state != CDC_TRANSFER_DATA)))
+  {
+    return USBH_BUSY;
+  }
+
+  CDC_Handle->pUserLineCoding = linecoding;
+  CDC_Handle->state = CDC_SET_LINE_CODING_STATE;
+  return USBH_OK;
+}
+
+/**
+  * @brief  Send the SET_LINE_CODING request
+  * @param  pdev: Selected device
+  * @param  phost: Selected host
+  * @retval Status of the control request
+  */
+static USBH_Status CDC_SetLineCodingReq(USB_OTG_CORE_HANDLE *pdev,
+                                        USBH_HOST *phost)
+{
+  CDC_HandleTypeDef *CDC_Handle = (CDC_HandleTypeDef *)&_CDC_Handle;
+
+  phost->Control.setup.b.bmRequestType = USB_H2D | USB_REQ_TYPE_CLASS | \
+    USB_REQ_RECIPIENT_INTERFACE;
+
+  phost->Control.setup.b.bRequest = CDC_SET_LINE_CODING;
+  phost->Control.setup.b.wValue.w = 0;
+  phost->Control.setup.b.wIndex.w = 0;
+  phost->Control.setup.b.wLength.w = LINE_CODING_STRUCTURE_SIZE;
+
+  return USBH_CtlReq(pdev, phost, CDC_Handle->pUserLineCoding->Array,
+                     LINE_CODING_STRUCTURE_SIZE);
+}
+
+/**
+  * @brief  Abandon any transmission or reception in progress, halting the
+  *         data channels. No callbacks are made for abandoned transfers.
+  * @param  None
+  * @retval None
+  */
+void  USBH_CDC_Abort(void)
+{
+  CDC_HandleTypeDef *CDC_Handle = (CDC_HandleTypeDef *)&_CDC_Handle;
+  uint32_t oldpri;
+
+  USBH_CDC_StreamStop();
+
+  if (CDC_Dev == NULL)
+  {
+    return;
+  }
+
+  oldpri = IRQ_save(USB_IRQ_PRI);
+  if (CDC_Handle->data_tx_state != CDC_IDLE)
+  {
+    CDC_Handle->data_tx_state = CDC_IDLE;
+    USB_OTG_HC_Halt(CDC_Dev, CDC_Handle->DataItf.OutPipe);
+  }
+  if (CDC_Handle->data_rx_state != CDC_IDLE)
+  {
+    CDC_Handle->data_rx_state = CDC_IDLE;
+    USB_OTG_HC_Halt(CDC_Dev, CDC_Handle->DataItf.InPipe);
+  }
+  IRQ_restore(oldpri);
+}
+
 /**
   * @brief  This function prepares the state before issuing the class specific commands
   * @param  None
   * @retval None
   */
 USBH_Status  USBH_CDC_Transmit(uint8_t *pbuff, uint32_t length)
+{
+  CDC_HandleTypeDef *CDC_Handle = (CDC_HandleTypeDef *)&_CDC_Handle;
+
+  if (CDC_Handle->data_tx_state != CDC_IDLE)
+  {
+    return USBH_BUSY;
+  }
+
+  CDC_Handle->TxSingle.pbuff = pbuff;
+  CDC_Handle->TxSingle.length = length;
+  return USBH_CDC_TransmitSG(&CDC_Handle->TxSingle, 1);
+}
+
+/**
+  * @brief  Transmit a list of buffers as one continuous stream. Each
+  *         segment is sent as multi-packet URBs, queued back to back from
+  *         the completion interrupt. All but the last segment should be a
+  *         multiple of OutEpSize to avoid short packets mid-stream. The
+  *         list must remain valid until USBH_CDC_TransmitCallback().
+  * @param  seg: Segment list
+  * @param  nr: Number of segments
+  * @retval Status
+  */
+USBH_Status  USBH_CDC_TransmitSG(const CDC_TxSegTypeDef *seg, uint32_t nr)
 {
   USBH_Status Status = USBH_BUSY;
   CDC_HandleTypeDef *CDC_Handle = (CDC_HandleTypeDef *)&_CDC_Handle;
 
-  if ((CDC_Handle->state == CDC_IDLE_STATE) || (CDC_Handle->state == CDC_TRANSFER_DATA))
+  uint32_t oldpri;
+
+  if (((CDC_Handle->state == CDC_IDLE_STATE) || (CDC_Handle->state == CDC_TRANSFER_DATA))
+      && (CDC_Handle->data_tx_state == CDC_IDLE) && (nr != 0)
+      && (CDC_Dev != NULL))
   {
-    CDC_Handle->pTxData = pbuff;
-    CDC_Handle->TxDataLength = length;
+    CDC_Handle->pTxSeg = seg;
+    CDC_Handle->TxSegCount = nr;
+    CDC_Handle->pTxData = seg->pbuff;
+    CDC_Handle->TxDataLength = seg->length;
     CDC_Handle->state = CDC_TRANSFER_DATA;
-    CDC_Handle->data_tx_state = CDC_SEND_DATA;
+
+    /* Submit now rather than on the next USBH_Process(). */
+    oldpri = IRQ_save(USB_IRQ_PRI);
+    CDC_Handle->data_tx_state = CDC_SEND_DATA_WAIT;
+    CDC_SubmitTransmission(CDC_Dev);
+    IRQ_restore(oldpri);
     Status = USBH_OK;
 
   }
@@ -230,12 +405,24 @@ USBH_Status  USBH_CDC_Receive(uint8_t *pbuff, uint32_t length)
   USBH_Status Status = USBH_BUSY;
   CDC_HandleTypeDef *CDC_Handle = (CDC_HandleTypeDef *)&_CDC_Handle;
 
-  if ((CDC_Handle->state == CDC_IDLE_STATE) || (CDC_Handle->state == CDC_TRANSFER_DATA))
+  uint32_t oldpri;
+
+  if (((CDC_Handle->state == CDC_IDLE_STATE) || (CDC_Handle->state == CDC_TRANSFER_DATA))
+      && !CDC_Stream.active && (CDC_Dev != NULL))
   {
     CDC_Handle->pRxData = pbuff;
     CDC_Handle->RxDataLength = length;
     CDC_Handle->state = CDC_TRANSFER_DATA;
-    CDC_Handle->data_rx_state = CDC_RECEIVE_DATA;
+
+    /* Submit now rather than on the next USBH_Process(). This may be
+     * called from USBH_CDC_TransmitCallback(). */
+    oldpri = IRQ_save(USB_IRQ_PRI);
+    CDC_Handle->data_rx_state = CDC_RECEIVE_DATA_WAIT;
+    USBH_BulkReceiveData(CDC_Dev,
+                         CDC_Handle->pRxData,
+                         CDC_Handle->DataItf.InEpSize,
+                         CDC_Handle->DataItf.InPipe);
+    IRQ_restore(oldpri);
     Status = USBH_OK;
 
   }
@@ -243,7 +430,9 @@ USBH_Status  USBH_CDC_Receive(uint8_t *pbuff, uint32_t length)
 }
 
 /**
-* @brief  The function is responsible for sending data to the device
+* @brief  The function is responsible for resending data to the device
+*         after a NAK. Retries are paced by the main loop, so that a device
+*         which NAKs indefinitely cannot starve it.
 *  @param  pdev: Selected device
 * @retval None
 */
@@ -251,73 +440,117 @@ static void CDC_ProcessTransmission(USB_OTG_CORE_HANDLE *pdev ,
                                    void   *phost)
 {
     CDC_HandleTypeDef *CDC_Handle = (CDC_HandleTypeDef *)&_CDC_Handle;
-    URB_STATE URB_Status = URB_IDLE;
+    uint32_t oldpri;
 
-  switch (CDC_Handle->data_tx_state)
+  if (CDC_Handle->data_tx_state == CDC_SEND_DATA)
   {
-    case CDC_SEND_DATA:
-      if (CDC_Handle->TxDataLength > CDC_Handle->DataItf.OutEpSize)
-      {
-        USBH_BulkSendData(pdev,
-                          CDC_Handle->pTxData,
-                          CDC_Handle->DataItf.OutEpSize,
-                          CDC_Handle->DataItf.OutPipe);
-      }
-      else
-      {
-        USBH_BulkSendData(pdev,
-                          CDC_Handle->pTxData,
-                          (uint16_t)CDC_Handle->TxDataLength,
-                          CDC_Handle->DataItf.OutPipe);
-      }
-
+      /* The completion interrupt also submits on this channel. */
+      oldpri = IRQ_save(USB_IRQ_PRI);
       CDC_Handle->data_tx_state = CDC_SEND_DATA_WAIT;
-      break;
+      CDC_SubmitTransmission(pdev);
+      IRQ_restore(oldpri);
+  }
+}
 
-    case CDC_SEND_DATA_WAIT:
+/**
+* @brief  Handle a completion event on the OUT channel
+*  @param  pdev: Selected device
+* @retval None
+*/
+static void CDC_TransmitEvent(USB_OTG_CORE_HANDLE *pdev)
+{
+    CDC_HandleTypeDef *CDC_Handle = (CDC_HandleTypeDef *)&_CDC_Handle;
+    URB_STATE URB_Status;
 
-      URB_Status = HCD_GetURB_State(pdev, CDC_Handle->DataItf.OutPipe);
+    if (CDC_Handle->data_tx_state != CDC_SEND_DATA_WAIT)
+    {
+        return;
+    }
 
-      /* Check the status done for transmission */
-      if (URB_Status == URB_DONE)
-      {
-        if (CDC_Handle->TxDataLength > CDC_Handle->DataItf.OutEpSize)
-        {
-          CDC_Handle->TxDataLength -= CDC_Handle->DataItf.OutEpSize;
-          CDC_Handle->pTxData += CDC_Handle->DataItf.OutEpSize;
-        }
-        else
-        {
-          CDC_Handle->TxDataLength = 0U;
-        }
+    URB_Status = HCD_GetURB_State(pdev, CDC_Handle->DataItf.OutPipe);
 
-        if (CDC_Handle->TxDataLength > 0U)
-        {
-          CDC_Handle->data_tx_state = CDC_SEND_DATA;
-        }
-        else
-        {
-          CDC_Handle->data_tx_state = CDC_IDLE;
-          USBH_CDC_TransmitCallback();
-        }
+    /* The completion interrupt queues further URBs until all data is
+     * sent: URB_DONE is seen here only at the very end. */
+    if (URB_Status == URB_DONE)
+    {
+        CDC_Handle->data_tx_state = CDC_IDLE;
+        USBH_CDC_TransmitCallback();
+    }
+    else if (URB_Status == URB_NOTREADY)
+    {
+        /* NAKed: resend the unacknowledged remainder. */
+        CDC_Handle->data_tx_state = CDC_SEND_DATA;
+    }
+}
 
-      }
-      else
-      {
-        if (URB_Status == URB_NOTREADY)
-        {
-          CDC_Handle->data_tx_state = CDC_SEND_DATA;
+/**
+* @brief  Submit one URB for as much of the current segment as the channel
+*         allows (at most 256 packets)
+* @param  pdev: Selected device
+* @retval None
+*/
+static void CDC_SubmitTransmission(USB_OTG_CORE_HANDLE *pdev)
+{
+    CDC_HandleTypeDef *CDC_Handle = (CDC_HandleTypeDef *)&_CDC_Handle;
+    uint32_t max = min_t(uint32_t, CDC_Handle->DataItf.OutEpSize * 256U,
+                         0x8000U);
+
+    CDC_Handle->TxUrbLength = min_t(uint32_t, CDC_Handle->TxDataLength, max);
+    USBH_BulkSendData(pdev,
+                      CDC_Handle->pTxData,
+                      (uint16_t)CDC_Handle->TxUrbLength,
+                      CDC_Handle->DataItf.OutPipe);
+}
 
-        }
-      }
-      break;
+/**
+* @brief  URB completion hook for the OUT channel. Accounts for acknowledged
+*         data, and immediately submits the next URB if there is more.
+* @param  pdev: Selected device
+* @param  hc_num: Channel number
+* @retval None
+*/
+static void CDC_TransmitComplete(USB_OTG_CORE_HANDLE *pdev, uint8_t hc_num)
+{
+    CDC_HandleTypeDef *CDC_Handle = (CDC_HandleTypeDef *)&_CDC_Handle;
+    URB_STATE URB_Status = HCD_GetURB_State(pdev, hc_num);
+    uint32_t done;
 
-    default:
-      break;
-  }
+    if (CDC_Handle->data_tx_state != CDC_SEND_DATA_WAIT)
+    {
+        return;
+    }
+
+    if (URB_Status == URB_DONE)
+    {
+        done = CDC_Handle->TxUrbLength;
+    }
+    else if (URB_Status == URB_NOTREADY)
+    {
+        done = HCD_GetXferCnt(pdev, hc_num);
+    }
+    else
+    {
+        return;
+    }
+
+    CDC_Handle->pTxData += done;
+    CDC_Handle->TxDataLength -= done;
+    while ((CDC_Handle->TxDataLength == 0) && (CDC_Handle->TxSegCount > 1))
+    {
+        CDC_Handle->pTxSeg++;
+        CDC_Handle->TxSegCount--;
+        CDC_Handle->pTxData = CDC_Handle->pTxSeg->pbuff;
+        CDC_Handle->TxDataLength = CDC_Handle->pTxSeg->length;
+    }
+
+    if ((URB_Status == URB_DONE) && (CDC_Handle->TxDataLength != 0))
+    {
+        CDC_SubmitTransmission(pdev);
+    }
 }
 /**
-* @brief  This function responsible for reception of data from the device
+* @brief  This function responsible for re-requesting data from the device
+*         after a zero-length packet
 *  @param  pdev: Selected device
 * @retval None
 */
@@ -326,46 +559,322 @@ static void CDC_ProcessReception(USB_OTG_CORE_HANDLE *pdev ,
                                  void   *phost)
 {
     CDC_HandleTypeDef *CDC_Handle = (CDC_HandleTypeDef *)&_CDC_Handle;
-  URB_STATE URB_Status = URB_IDLE;
-  uint32_t length;
+    uint32_t oldpri;
 
-  switch (CDC_Handle->data_rx_state)
+  if (CDC_Handle->data_rx_state == CDC_RECEIVE_DATA)
   {
-
-    case CDC_RECEIVE_DATA:
-
+      oldpri = IRQ_save(USB_IRQ_PRI);
+      CDC_Handle->data_rx_state = CDC_RECEIVE_DATA_WAIT;
       USBH_BulkReceiveData(pdev,
                            CDC_Handle->pRxData,
                            CDC_Handle->DataItf.InEpSize,
                            CDC_Handle->DataItf.InPipe);
+      IRQ_restore(oldpri);
+  }
+}
 
-      CDC_Handle->data_rx_state = CDC_RECEIVE_DATA_WAIT;
+/**
+* @brief  Handle a completion event on the IN channel
+*  @param  pdev: Selected device
+* @retval None
+*/
+static void CDC_ReceiveEvent(USB_OTG_CORE_HANDLE *pdev)
+{
+    CDC_HandleTypeDef *CDC_Handle = (CDC_HandleTypeDef *)&_CDC_Handle;
+    uint32_t length;
 
-      break;
+    if ((CDC_Handle->data_rx_state != CDC_RECEIVE_DATA_WAIT)
+        || (HCD_GetURB_State(pdev, CDC_Handle->DataItf.InPipe) != URB_DONE))
+    {
+        return;
+    }
+
+    length = HCD_GetXferCnt(pdev, CDC_Handle->DataItf.InPipe);
+
+    if (length == 0)
+    {
+        CDC_Handle->data_rx_state = CDC_RECEIVE_DATA;
+    }
+    else
+    {
+        CDC_Handle->RxDataLength = length;
+        CDC_Handle->data_rx_state = CDC_IDLE;
+        USBH_CDC_ReceiveCallback();
+    }
+}
+
+/**
+* @brief  Link quality counters of the data channels
+* @param  out: Returns OUT channel counters
+* @param  in: Returns IN channel counters
+* @retval None
+*/
+void  USBH_CDC_GetLinkStats(USB_OTG_HC_STATS *out, USB_OTG_HC_STATS *in)
+{
+  CDC_HandleTypeDef *CDC_Handle = (CDC_HandleTypeDef *)&_CDC_Handle;
+  uint32_t oldpri;
 
-    case CDC_RECEIVE_DATA_WAIT:
+  memset(out, 0, sizeof(*out));
+  memset(in, 0, sizeof(*in));
+  if (CDC_Dev == NULL)
+  {
+    return;
+  }
 
-      URB_Status = HCD_GetURB_State(pdev, CDC_Handle->DataItf.InPipe);
+  oldpri = IRQ_save(USB_IRQ_PRI);
+  *out = CDC_Dev->host.Stats[CDC_Handle->DataItf.OutPipe];
+  *in = CDC_Dev->host.Stats[CDC_Handle->DataItf.InPipe];
+  IRQ_restore(oldpri);
+}
 
-      /*Check the status done for reception*/
-      if (URB_Status == URB_DONE)
-      {
-        length = HCD_GetXferCnt(pdev, CDC_Handle->DataItf.InPipe);
+/**
+* @brief  Dispatch queued URB completion events to the transmit and receive
+*         state machines, and from there to USBH_CDC_TransmitCallback() and
+*         USBH_CDC_ReceiveCallback(). Called from the BSP's URB event
+*         handler, below USB IRQ priority.
+*  @param  pdev: Selected device
+* @retval None
+*/
+void USBH_CDC_ProcessEvents(USB_OTG_CORE_HANDLE *pdev)
+{
+    CDC_HandleTypeDef *CDC_Handle = (CDC_HandleTypeDef *)&_CDC_Handle;
+    uint8_t hc_num;
 
-        if (length == 0)
+    while (HCD_GetURB_Event(pdev, &hc_num))
+    {
+        if (CDC_Handle->state != CDC_TRANSFER_DATA)
+        {
+            continue;
+        }
+        if ((hc_num == CDC_Handle->DataItf.OutPipe) || (hc_num == URB_EVT_ANY))
         {
-          CDC_Handle->data_rx_state = CDC_RECEIVE_DATA;
+            CDC_TransmitEvent(pdev);
         }
-        else
+        if ((hc_num == CDC_Handle->DataItf.InPipe) || (hc_num == URB_EVT_ANY))
         {
-          CDC_Handle->data_rx_state = CDC_IDLE;
-          USBH_CDC_ReceiveCallback();
+            CDC_ReceiveEvent(pdev);
         }
+    }
+}
 
-      }
-      break;
+/**
+* @brief  Start streaming reception into a ring buffer. The buffer is divided
+*         into InEpSize slots (rounded down to a power of two, at most
+*         CDC_STREAM_MAX_SLOTS). Normal reception is unavailable until
+*         USBH_CDC_StreamStop().
+* @param  pbuff: Ring buffer
+* @param  size: Size of ring buffer in bytes
+* @retval Status
+*/
+USBH_Status  USBH_CDC_StreamStart(uint8_t *pbuff, uint32_t size)
+{
+  CDC_HandleTypeDef *CDC_Handle = (CDC_HandleTypeDef *)&_CDC_Handle;
+  uint16_t nr;
+  uint32_t oldpri;
+
+  if (((CDC_Handle->state != CDC_IDLE_STATE) && (CDC_Handle->state != CDC_TRANSFER_DATA))
+      || (CDC_Handle->data_rx_state != CDC_IDLE)
+      || CDC_Stream.active || (CDC_Dev == NULL)
+      || (CDC_Handle->DataItf.InEpSize == 0))
+  {
+    return USBH_BUSY;
+  }
+
+  nr = min_t(uint32_t, size / CDC_Handle->DataItf.InEpSize,
+             CDC_STREAM_MAX_SLOTS);
+  while (nr & (nr - 1))
+  {
+    nr &= nr - 1;
+  }
+  if (nr == 0)
+  {
+    return USBH_FAIL;
+  }
+
+  oldpri = IRQ_save(USB_IRQ_PRI);
+  CDC_Stream.buf = pbuff;
+  CDC_Stream.nr_slots = nr;
+  CDC_Stream.slot_size = CDC_Handle->DataItf.InEpSize;
+  CDC_Stream.prod = CDC_Stream.cons = CDC_Stream.cons_off = 0;
+  CDC_Stream.armed = 0;
+  CDC_Stream.error = 0;
+  CDC_Stream.active = 1;
+  CDC_Dev->host.URB_Cb[CDC_Handle->DataItf.InPipe] = CDC_StreamComplete;
+  CDC_StreamArm();
+  IRQ_restore(oldpri);
+
+  return USBH_OK;
+}
+
+/**
+* @brief  Stop streaming reception. Any unconsumed data is discarded.
+* @param  None
+* @retval None
+*/
+void  USBH_CDC_StreamStop(void)
+{
+  CDC_HandleTypeDef *CDC_Handle = (CDC_HandleTypeDef *)&_CDC_Handle;
+  uint32_t oldpri;
 
-    default:
+  oldpri = IRQ_save(USB_IRQ_PRI);
+  if (CDC_Stream.active)
+  {
+    CDC_Stream.active = 0;
+    CDC_Dev->host.URB_Cb[CDC_Handle->DataItf.InPipe] = NULL;
+    if (CDC_Stream.armed)
+    {
+      USB_OTG_HC_Halt(CDC_Dev, CDC_Handle->DataItf.InPipe);
+      CDC_Stream.armed = 0;
+    }
+  }
+  IRQ_restore(oldpri);
+}
+
+/**
+* @brief  Get the oldest unconsumed stream data, without copying.
+* @param  plen: Returns number of contiguous bytes available
+* @retval Pointer to data, or NULL if none is available
+*/
+uint8_t  *USBH_CDC_StreamPeek(uint32_t *plen)
+{
+  uint16_t mask = CDC_Stream.nr_slots - 1;
+  uint16_t p = CDC_Stream.cons, prod = CDC_Stream.prod;
+  uint8_t *data;
+  uint32_t len;
+
+  barrier(); /* read prod before slot contents */
+
+  if (p == prod)
+  {
+    *plen = 0;
+    return NULL;
+  }
+
+  data = CDC_Stream.buf + (p & mask) * CDC_Stream.slot_size
+    + CDC_Stream.cons_off;
+  len = CDC_Stream.len[p & mask] - CDC_Stream.cons_off;
+
+  /* Full slots are followed directly by the next packet's data. */
+  while ((CDC_Stream.len[p & mask] == CDC_Stream.slot_size)
+         && (++p != prod) && ((p & mask) != 0))
+  {
+    len += CDC_Stream.len[p & mask];
+  }
+
+  *plen = len;
+  return data;
+}
+
+/**
+* @brief  Release stream data returned by USBH_CDC_StreamPeek().
+* @param  len: Number of bytes consumed
+* @retval None
+*/
+void  USBH_CDC_StreamConsume(uint32_t len)
+{
+  uint16_t mask = CDC_Stream.nr_slots - 1;
+  uint32_t avail, oldpri;
+
+  while (len != 0)
+  {
+    avail = CDC_Stream.len[CDC_Stream.cons & mask] - CDC_Stream.cons_off;
+    if (len < avail)
+    {
+      CDC_Stream.cons_off += len;
       break;
+    }
+    len -= avail;
+    CDC_Stream.cons_off = 0;
+    barrier(); /* finish with slot before releasing it */
+    CDC_Stream.cons++;
+  }
+
+  /* Restart the channel if it stalled on a full ring. */
+  if (!CDC_Stream.armed)
+  {
+    oldpri = IRQ_save(USB_IRQ_PRI);
+    CDC_StreamArm();
+    IRQ_restore(oldpri);
   }
 }
+
+/**
+* @brief  Has streaming reception stopped due to a transfer error?
+* @param  None
+* @retval Non-zero on error
+*/
+uint8_t  USBH_CDC_StreamError(void)
+{
+  return CDC_Stream.error;
+}
+
+/**
+* @brief  Submit one URB covering all free slots up to the end of the ring.
+*         Called in USB IRQ context, or with the USB IRQ masked.
+* @param  None
+* @retval None
+*/
+static void CDC_StreamArm(void)
+{
+  CDC_HandleTypeDef *CDC_Handle = (CDC_HandleTypeDef *)&_CDC_Handle;
+  uint16_t mask = CDC_Stream.nr_slots - 1;
+  uint16_t slot = CDC_Stream.prod & mask;
+  uint16_t nr;
+
+  if (!CDC_Stream.active || CDC_Stream.armed)
+  {
+    return;
+  }
+
+  nr = CDC_Stream.nr_slots - (uint16_t)(CDC_Stream.prod - CDC_Stream.cons);
+  nr = min_t(uint16_t, nr, CDC_Stream.nr_slots - slot);
+  if (nr == 0)
+  {
+    return;
+  }
+
+  CDC_Stream.armed = nr;
+  USBH_BulkReceiveData(CDC_Dev,
+                       CDC_Stream.buf + slot * CDC_Stream.slot_size,
+                       nr * CDC_Stream.slot_size,
+                       CDC_Handle->DataItf.InPipe);
+}
+
+/**
+* @brief  URB completion hook for the IN channel while streaming.
+* @param  pdev: Selected device
+* @param  hc_num: Channel number
+* @retval None
+*/
+static void CDC_StreamComplete(USB_OTG_CORE_HANDLE *pdev, uint8_t hc_num)
+{
+  uint16_t mask = CDC_Stream.nr_slots - 1;
+  uint32_t count, n;
+
+  if (!CDC_Stream.active || !CDC_Stream.armed)
+  {
+    return;
+  }
+  CDC_Stream.armed = 0;
+
+  if (HCD_GetURB_State(pdev, hc_num) != URB_DONE)
+  {
+    CDC_Stream.error = 1;
+    CDC_Stream.active = 0;
+    pdev->host.URB_Cb[hc_num] = NULL;
+    return;
+  }
+
+  /* Packets are full-sized except possibly the last. */
+  count = pdev->host.hc[hc_num].xfer_count;
+  while (count != 0)
+  {
+    n = min_t(uint32_t, count, CDC_Stream.slot_size);
+    CDC_Stream.len[CDC_Stream.prod & mask] = n;
+    count -= n;
+    barrier(); /* publish slot before advancing prod */
+    CDC_Stream.prod++;
+  }
+
+  CDC_StreamArm();
+}
@@ -182,6 +182,7 @@ USBH_Status USBH_DeInit(USB_OTG_CORE_HANDLE *pdev, USBH_HOST *phost)
 
     phost->gState = HOST_IDLE;
     phost->gStateBkp = HOST_IDLE;
+    phost->PortSettling = 0;
     phost->EnumState = ENUM_IDLE;
     phost->RequestState = CMD_SEND;
 
@@ -196,6 +197,36 @@ USBH_Status USBH_DeInit(USB_OTG_CORE_HANDLE *pdev, USBH_HOST *phost)
     return USBH_OK;
 }
 
+/**
+ * @brief  USBH_Delay
+ *         Wait in HOST_DELAY, without blocking the caller of USBH_Process()
+ * @param  phost: Selected host
+ * @param  msec: Delay in milliseconds
+ * @param  next: State to enter when the delay expires
+ * @retval None
+ */
+static void USBH_Delay(USBH_HOST *phost, uint32_t msec, HOST_State next)
+{
+    USB_OTG_BSP_InitTimer(&phost->Timer, msec);
+    phost->gStateNext = next;
+    phost->gState = HOST_DELAY;
+}
+
+/**
+ * @brief  USBH_PortReset
+ *         Start a timed port reset, sequenced through HOST_PORT_RESET and
+ *         HOST_PORT_RESET_DONE
+ * @param  phost: Selected host
+ * @param  next: State to enter when reset is complete
+ * @retval None
+ */
+static void USBH_PortReset(USBH_HOST *phost, HOST_State next)
+{
+    phost->PortSettling = 1;
+    phost->gStateReset = next;
+    phost->gState = HOST_PORT_RESET;
+}
+
 /**
  * @brief  USBH_Process
  *         USB Host core main state machine process
@@ -206,8 +237,11 @@ void USBH_Process(USB_OTG_CORE_HANDLE *pdev , USBH_HOST *phost)
 {
     volatile USBH_Status status = USBH_FAIL;
 
-    /* check for Host port events */
-    if (((HCD_IsDeviceConnected(pdev) == 0)|| (HCD_IsPortEnabled(pdev) == 0))&& (phost->gState != HOST_IDLE))
+    /* check for Host port events: the port is legitimately disabled while
+     * it is reset and re-enabled */
+    if (((HCD_IsDeviceConnected(pdev) == 0) ||
+         ((HCD_IsPortEnabled(pdev) == 0) && !phost->PortSettling))
+        && (phost->gState != HOST_IDLE))
     {
         if(phost->gState != HOST_DEV_DISCONNECTED)
         {
@@ -222,24 +256,46 @@ void USBH_Process(USB_OTG_CORE_HANDLE *pdev , USBH_HOST *phost)
 
         if (HCD_IsDeviceConnected(pdev))
         {
-            phost->gState = HOST_WAIT_PRT_ENABLED;
+            /* wait debounce delay, then apply a port RESET */
+            phost->PortSettling = 1;
+            phost->gStateReset = HOST_WAIT_PRT_ENABLED;
+            USBH_Delay(phost, 100, HOST_PORT_RESET);
+        }
+        break;
+
+    case HOST_DELAY:
+        if (USB_OTG_BSP_TimerFired(&phost->Timer))
+        {
+            phost->gState = phost->gStateNext;
+        }
+        break;
 
-            /*wait denounce delay */
-            USB_OTG_BSP_mDelay(100);
+    case HOST_PORT_RESET:
+        /* Timing as USB_OTG_ResetPort() */
+        HCD_DrivePortReset(pdev, 1);
+        USBH_Delay(phost, 100, HOST_PORT_RESET_DONE);
+        break;
 
-            /* Apply a port RESET */
-            HCD_ResetPort(pdev);
+    case HOST_PORT_RESET_DONE:
+        HCD_DrivePortReset(pdev, 0);
 
-            /* User RESET callback*/
-            phost->usr_cb->ResetDevice();
-        }
+        /* User RESET callback*/
+        phost->usr_cb->ResetDevice();
+
+        USBH_Delay(phost, 20, phost->gStateReset);
+
+        /* Give up on the port if it does not become enabled */
+        USB_OTG_BSP_InitTimer(&phost->PortTimer, 20 + 200);
         break;
 
     case HOST_WAIT_PRT_ENABLED:
         if (pdev->host.PortEnabled == 1)
         {
-            phost->gState = HOST_DEV_ATTACHED;
-            USB_OTG_BSP_mDelay(50);
+            USBH_Delay(phost, 50, HOST_DEV_ATTACHED);
+        }
+        else if (USB_OTG_BSP_TimerFired(&phost->PortTimer))
+        {
+            phost->gState = HOST_DEV_DISCONNECTED;
         }
         break;
 
@@ -250,9 +306,13 @@ void USBH_Process(USB_OTG_CORE_HANDLE *pdev , USBH_HOST *phost)
         phost->Control.hc_num_in = USBH_Alloc_Channel(pdev, 0x80);
 
         /* Reset USB Device */
-        if ( HCD_ResetPort(pdev) == 0)
+        USBH_PortReset(phost, HOST_DETECT_DEVICE_SPEED);
+        break;
+
+    case HOST_DETECT_DEVICE_SPEED:
+        if (pdev->host.PortEnabled == 1)
         {
-            phost->usr_cb->ResetDevice();
+            phost->PortSettling = 0;
 
             /* Host is Now ready to start the Enumeration */
             phost->device_prop.speed = HCD_GetCurrentSpeed(pdev);
@@ -276,6 +336,10 @@ void USBH_Process(USB_OTG_CORE_HANDLE *pdev , USBH_HOST *phost)
                                EP_TYPE_CTRL,
                                phost->Control.ep0size);
         }
+        else if (USB_OTG_BSP_TimerFired(&phost->PortTimer))
+        {
+            phost->gState = HOST_DEV_DISCONNECTED;
+        }
         break;
 
     case HOST_ENUMERATION:
@@ -468,7 +532,6 @@ static USBH_Status USBH_HandleEnum(USB_OTG_CORE_HANDLE *pdev, USBH_HOST *phost)
         /* set address */
         if ( USBH_SetAddress(pdev, phost, USBH_DEVICE_ADDRESS) == USBH_OK)
         {
-            USB_OTG_BSP_mDelay(2);
             phost->device_prop.address = USBH_DEVICE_ADDRESS;
 
             /* user callback for device address assigned */
@@ -489,6 +552,9 @@ static USBH_Status USBH_HandleEnum(USB_OTG_CORE_HANDLE *pdev, USBH_HOST *phost)
                                  0,
                                  0,
                                  0);
+
+            /* Allow the device 2ms to switch address */
+            USBH_Delay(phost, 2, HOST_ENUMERATION);
         }
         break;
 
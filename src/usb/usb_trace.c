@@ -0,0 +1,62 @@
+/*
+ * usb_trace.c
+ *
+ * Post-mortem dump of the USB host channel event trace.
+ *
+ * Written & released by Keir Fraser <keir.xen@gmail.com>
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+#include "usb_trace.h"
+
+struct usb_trace usb_trace;
+
+/* Dump header. Decode with scripts/usb_trace.py. */
+struct usb_trace_hdr {
+    char magic[4];
+    uint8_t version;
+    uint8_t ent_size;
+    uint16_t nr;
+    uint32_t time_mhz;
+};
+
+void usb_trace_dump(void)
+{
+    struct usb_trace_hdr hdr = {
+        .magic = "UTRC",
+        .version = 1,
+        .ent_size = sizeof(struct usb_trace_ent),
+        .time_mhz = TIME_MHZ
+    };
+    struct usb_trace_ent *e;
+    uint32_t oldpri, p, i;
+
+    /* Freeze the trace. */
+    oldpri = IRQ_save(USB_IRQ_PRI);
+
+    p = usb_trace.prod;
+    i = (p > USB_TRACE_NR) ? p - USB_TRACE_NR : 0;
+    hdr.nr = p - i;
+
+    console_printf("USB trace: %u events\n", hdr.nr);
+    console_write(&hdr, sizeof(hdr));
+    for (; i != p; i++) {
+        e = &usb_trace.ent[i & (USB_TRACE_NR-1)];
+        console_write(e, sizeof(*e));
+    }
+    console_printf("\n");
+
+    IRQ_restore(oldpri);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -11,8 +11,16 @@
 
 #include "usbh_cdc.h"
 
+#define USB_HUB_CLASS 0x09U
+
 static bool_t cdc_device_connected;
 
+/* The test sequencer drives a single DUT via the jig's one floppy header,
+ * so hubs are not enumerated. We note their presence for the operator. */
+static bool_t hub_attached;
+
+static struct usb_dut_desc dut_desc;
+
 extern USB_OTG_CORE_HANDLE USB_OTG_Core;
 USBH_HOST USB_Host;
 
@@ -25,6 +33,8 @@ static void USBH_USR_DeInit(void)
 {
     printk("> %s\n", __FUNCTION__);
     cdc_device_connected = FALSE;
+    hub_attached = FALSE;
+    memset(&dut_desc, 0, sizeof(dut_desc));
 }
 
 static void USBH_USR_DeviceAttached(void)
@@ -41,6 +51,8 @@ static void USBH_USR_DeviceDisconnected (void)
 {
     printk("> %s\n", __FUNCTION__);
     cdc_device_connected = FALSE;
+    hub_attached = FALSE;
+    memset(&dut_desc, 0, sizeof(dut_desc));
 }
 
 static void USBH_USR_OverCurrentDetected (void)
@@ -63,6 +75,8 @@ static void USBH_USR_DeviceDescAvailable(void *DeviceDesc)
     printk("> %s\n", __FUNCTION__);
     printk(" VID : %04X\n", hs->idVendor);
     printk(" PID : %04X\n", hs->idProduct);
+    dut_desc.vid = hs->idVendor;
+    dut_desc.pid = hs->idProduct;
 }
 
 static void USBH_USR_DeviceAddressAssigned(void)
@@ -80,7 +94,9 @@ static void USBH_USR_ConfigurationDescAvailable(
     printk("> %s\n", __FUNCTION__);
     printk("> Class connected: %02x (%s)\n",
            id->bInterfaceClass,
-           (id->bInterfaceClass == USB_CDC_CLASS) ? "CDC" : "???");
+           (id->bInterfaceClass == USB_CDC_CLASS) ? "CDC" :
+           (id->bInterfaceClass == USB_HUB_CLASS) ? "Hub" : "???");
+    hub_attached = (id->bInterfaceClass == USB_HUB_CLASS);
 }
 
 static void USBH_USR_ManufacturerString(void *ManufacturerString)
@@ -96,6 +112,8 @@ static void USBH_USR_ProductString(void *ProductString)
 static void USBH_USR_SerialNumString(void *SerialNumString)
 {
     printk(" Serial Number : %s\n", (char *)SerialNumString);
+    snprintf(dut_desc.serial, sizeof(dut_desc.serial), "%s",
+             (char *)SerialNumString);
 }
 
 static void USBH_USR_EnumerationDone(void)
@@ -173,6 +191,38 @@ bool_t usbh_cdc_connected(void)
     return cdc_device_connected && HCD_IsDeviceConnected(&USB_OTG_Core);
 }
 
+void usbh_cdc_link_stats(struct usb_link_stats *out,
+                         struct usb_link_stats *in)
+{
+    USBH_CDC_GetLinkStats(out, in);
+}
+
+/* Line coding used as an out-of-band control channel to the DUT. */
+static CDC_LineCodingTypeDef line_coding = {
+    .b = { .bCharFormat = 0, .bParityType = 0, .bDataBits = 8 }
+};
+
+bool_t usbh_cdc_set_baud(uint32_t baud)
+{
+    line_coding.b.dwDTERate = baud;
+    return USBH_CDC_SetLineCoding(&USB_Host, &line_coding) == USBH_OK;
+}
+
+void usbh_cdc_abort(void)
+{
+    USBH_CDC_Abort();
+}
+
+bool_t usbh_hub_attached(void)
+{
+    return hub_attached && HCD_IsDeviceConnected(&USB_OTG_Core);
+}
+
+void usbh_dut_desc(struct usb_dut_desc *desc)
+{
+    *desc = dut_desc;
+}
+
 /*
  * Local variables:
  * mode: C